@@ -30,7 +30,7 @@ over:
   mov %ax,%ds
   mov $startup_msg,%si        # skriv ut en melding
   call start_write
-  jmp load                    # hopp til innlesning fra disk
+  jmp memory_map              # hent minnekart, så innlesning fra disk
 
 start_write:                  # skriver ut ved å bruke bios funksjon int 10 0x0e
   mov $0x0e,%ah               # bios utskriftfunsjon
@@ -53,6 +53,29 @@ load_fail:                    # hvis vi ikke leste inn os riktig
   call start_write
   jmp forever
 
+memory_map:                   # lagrer bios minnekart (int 15 e820) på 0x500, se memory.c
+  xor %ax,%ax
+  mov %ax,%es                 # ES:DI peker på første entry på 0x0000:0x0504
+  mov $0x0504,%di
+  xor %ebx,%ebx               # 0 for første entry, bios setter neste
+  xor %bp,%bp                 # antall entries
+memory_map_next:
+  mov $0xe820,%eax            # bios funksjon e820
+  mov $24,%ecx                # størrelse på en entry
+  mov $0x534d4150,%edx        # "SMAP"
+  int $0x15
+  jc memory_map_done          # carry betyr ingen (flere) entries
+  cmp $0x534d4150,%eax
+  jne memory_map_done
+  inc %bp
+  add $24,%di
+  cmp $32,%bp                 # plass til 32 entries (E820_MAX_ENTRIES)
+  jae memory_map_done
+  test %ebx,%ebx              # 0 betyr siste entry
+  jnz memory_map_next
+memory_map_done:
+  mov %bp,%es:0x0500          # lagre antall entries
+
 load:
   mov $load_msg,%si
   call start_write
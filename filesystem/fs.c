@@ -401,7 +401,7 @@ void fs_init(void)
     block_read_part(SUPER_BLOCK_START,0, sizeof(super), &super);
     if(super.ninodes != MAX_INODES
        || super.ndata_blks != FS_BLOCKS - INODE_BLOCKS - BITMAP_BLOCKS - 1
-       || super.max_filesize != 4096
+       || super.max_filesize != MAX_FILESIZE
        ) {
         fs_mkfs();
     }
@@ -439,7 +439,7 @@ void fs_mkfs(void)
 
     super.ninodes = 512;
     super.ndata_blks = FS_BLOCKS - INODE_BLOCKS - BITMAP_BLOCKS - 1;
-    super.max_filesize = 4096;
+    super.max_filesize = MAX_FILESIZE;
     int root = create_directory(-1);
     if(root < 0) {
         scrprintf(0,0,"COULD NOT CREATE ROOT DIRECTORY\n");
@@ -521,6 +521,35 @@ int fs_open(const char *filename, int mode)
     }
     return retval;
 }
+/* Gives the paging code the inode of a open file, for memory mapping it
+ * The inode counts as open until fs_unmap() is called.
+ * params:
+ *   int fd : the file descriptor
+ *   int* size : int to write the file size to
+ *   int* writable : int to write 1 to if the file is open for writing
+ * returns the inode or error msg
+ */
+int fs_map(int fd, int* size, int* writable)
+{
+    if(fd < 0 || fd >= MAX_OPEN_FILES) {
+        return FSE_ERROR;
+    }
+    int mode = current_running->filedes[fd].mode;
+    if((mode & (MODE_RDONLY | MODE_RDWR)) == 0) {
+        return FSE_INVALIDMODE;
+    }
+    int id = current_running->filedes[fd].idx;
+    inodes[id].open_count++;
+    *size = inodes[id].d_inode.size;
+    *writable = (mode & MODE_RDWR) != 0;
+    return id;
+}
+/* Releases a inode mapped with fs_map() */
+void fs_unmap(inode_t id)
+{
+    inodes[id].open_count--;
+}
+
 /* Closes the file descriptor */
 int fs_close(int fd)
 {
@@ -52,6 +52,7 @@ enum {
     MAX_FILENAME_LEN = 14,
     MAX_PATH_LEN = 256, /* Total length of a path */
     STAT_SIZE = 6,      /* Size of the information returned by fs_stat */
+    MAX_FILESIZE = 4096, /* Largest file, also the largest memory mapping */
 };
 
 /* A directory entry */
@@ -81,6 +82,12 @@ int fs_link(char *linkname, char *filename);
 int fs_unlink(char *linkname);
 int fs_stat(int fd, char *buffer);
 
+/* Used by the paging code for memory mapped files */
+int fs_map(int fd, int *size, int *writable);
+void fs_unmap(inode_t id);
+int db_read(inode_t id, char *buffer, int size, int start_pos);
+int db_write(inode_t id, char *buffer, int size, int start_pos);
+
 
 int fs_mkdir(char *dir_name);
 int fs_chdir(char *path);
@@ -0,0 +1,87 @@
+/*  syscall.c
+ * The system call table, made from SYSCALLS() in syscall.h, and
+ * system_call_helper() which both entries in entry.S call. The number
+ * comes in %eax and up to five arguments in %ebx, %ecx, %edx, %esi
+ * and %edi, they are pushed as they are and handed straight on.
+ *
+ * do_ring_enter() runs a batch of filesystem and mailbox calls queued
+ * on a struct syscall_ring, so a process can pay for one trap instead
+ * of one per call. It trusts the ring as much as a direct call trusts
+ * its registers, see SYSCALLS().
+ *
+ * Best viewed with tabs set to 4 spaces.
+ */
+#include "common.h"
+#include "kernel.h"
+#include "scheduler.h"
+#include "interrupt.h"
+#include "util.h"
+#include "syscall.h"
+#include "mbox.h"
+#include "keyboard.h"
+#include "fs.h"
+#include "memory.h"
+
+typedef int (*syscall_t)(uint32_t, uint32_t, uint32_t, uint32_t, uint32_t);
+
+/* The caller cleans up the stack in C, so every handler can be called
+ * with all five arguments and just use the ones it has.
+ */
+static const syscall_t syscall[SYSCALL_COUNT] = {
+#define SYSCALL_HANDLER(name, fn, batch) [SYSCALL_##name] = (syscall_t)fn,
+    SYSCALLS(SYSCALL_HANDLER)
+#undef SYSCALL_HANDLER
+};
+
+/* Calls that may be queued on a ring */
+static const bool_t batchable[SYSCALL_COUNT] = {
+#define SYSCALL_BATCH(name, fn, batch) [SYSCALL_##name] = batch,
+    SYSCALLS(SYSCALL_BATCH)
+#undef SYSCALL_BATCH
+};
+
+/* Runs a system call, called from entry.S inside a critical section.
+ * params:
+ *   int fn : the system call number
+ *   uint32_t arg1-arg5 : arguments from %ebx, %ecx, %edx, %esi and %edi
+ * returns: what the handler returns, in %eax
+ */
+int system_call_helper(int fn, uint32_t arg1, uint32_t arg2, uint32_t arg3,
+                       uint32_t arg4, uint32_t arg5) {
+    ASSERT2(current_running->nested_count == 0, "A process/thread that was running inside the kernel made a syscall.");
+    // Illegal system call number, call exit instead
+    if(fn < 0 || fn >= SYSCALL_COUNT) {
+        fn = SYSCALL_EXIT;
+    }
+    current_running->nested_count++;
+    leave_critical();
+    int ret = syscall[fn](arg1, arg2, arg3, arg4, arg5);
+    enter_critical();
+    current_running->nested_count--;
+    return ret;
+}
+
+/* Runs the calls queued on a submission ring, until it is empty or the
+ * completion ring is full.
+ * params:
+ *   struct syscall_ring* ring : ring in the memory of the process
+ * returns: number of calls run
+ */
+int do_ring_enter(struct syscall_ring* ring) {
+    int count = 0;
+    while(ring->sq_head != ring->sq_tail && ring->cq_tail - ring->cq_head < RING_ENTRIES) {
+        struct syscall_sqe* sqe = &ring->sq[ring->sq_head % RING_ENTRIES];
+        struct syscall_cqe* cqe = &ring->cq[ring->cq_tail % RING_ENTRIES];
+        cqe->user_data = sqe->user_data;
+        if(sqe->fn < 0 || sqe->fn >= SYSCALL_COUNT || batchable[sqe->fn] == FALSE) {
+            cqe->result = -1;
+        } else {
+            cqe->result = syscall[sqe->fn](sqe->args[0], sqe->args[1], sqe->args[2],
+                                           sqe->args[3], sqe->args[4]);
+        }
+        ring->sq_head++;
+        ring->cq_tail++;
+        count++;
+    }
+    return count;
+}
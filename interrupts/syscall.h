@@ -0,0 +1,171 @@
+#ifndef SYSCALL_H
+#define SYSCALL_H
+
+#include "common.h"
+#include "kernel.h"
+#include "memory.h"
+
+enum {
+    /* sysenter MSRs (IA-32 SDM vol. 3, 5.8.7) */
+    SYSENTER_CS_MSR = 0x174,
+    SYSENTER_ESP_MSR = 0x175,
+    SYSENTER_EIP_MSR = 0x176,
+
+    /* cpuid leaf 1, edx, checked by init_sysenter() */
+    CPUID_SEP = 1 << 11,            /* sysenter/sysexit */
+
+    /* entries in each half of a struct syscall_ring */
+    RING_ENTRIES = 64,
+};
+
+/*
+ * Every system call, in order: name, handler, and if it may be queued
+ * on a struct syscall_ring. The numbers and the table in syscall.c are
+ * made from this list, so a new call only needs a line here.
+ * No handler checks the pointers it is given, whether they come in
+ * registers or on a ring. Threads call the same functions with kernel
+ * pointers, so a process is trusted with them as well. A new call should
+ * not add a check of its own.
+ */
+#define SYSCALLS(X)                     \
+    X(YIELD, yield, FALSE)              \
+    X(EXIT, exit, FALSE)                \
+    X(GETCHAR, getchar, FALSE)          \
+    X(MBOX_OPEN, mbox_open, TRUE)       \
+    X(MBOX_CLOSE, mbox_close, TRUE)     \
+    X(MBOX_STAT, mbox_stat, TRUE)       \
+    X(MBOX_RECV, mbox_recv, TRUE)       \
+    X(MBOX_SEND, mbox_send, TRUE)       \
+    X(OPEN, fs_open, TRUE)              \
+    X(CLOSE, fs_close, TRUE)            \
+    X(READ, fs_read, TRUE)              \
+    X(WRITE, fs_write, TRUE)            \
+    X(LSEEK, fs_lseek, TRUE)            \
+    X(LINK, fs_link, TRUE)              \
+    X(UNLINK, fs_unlink, TRUE)          \
+    X(STAT, fs_stat, TRUE)              \
+    X(MKDIR, fs_mkdir, TRUE)            \
+    X(CHDIR, fs_chdir, TRUE)            \
+    X(RMDIR, fs_rmdir, TRUE)            \
+    X(SBRK, do_sbrk, FALSE)             \
+    X(MMAP, do_mmap, FALSE)             \
+    X(MUNMAP, do_munmap, FALSE)         \
+    X(PAGING_STATS, get_paging_stats, FALSE) \
+    X(RING_ENTER, do_ring_enter, FALSE)
+
+enum {
+#define SYSCALL_NUMBER(name, fn, batch) SYSCALL_##name,
+    SYSCALLS(SYSCALL_NUMBER)
+#undef SYSCALL_NUMBER
+    SYSCALL_COUNT
+};
+
+/*
+ * Submission and completion ring, kept in the memory of the process.
+ * The process fills sq[sq_tail % RING_ENTRIES] and bumps sq_tail, then
+ * makes one SYSCALL_RING_ENTER for the whole batch. The kernel runs the
+ * entries in order and puts the results in cq, the process reads them
+ * from cq_head to cq_tail. Entries that do not fit in cq are left in sq.
+ */
+struct syscall_sqe {
+    int fn; // System call number, must be queueable in SYSCALLS()
+    uint32_t args[5]; // Arguments as for invoke_syscall()
+    uint32_t user_data; // Copied to the completion
+};
+
+struct syscall_cqe {
+    uint32_t user_data; // From the submission
+    int result; // What the call returned, -1 if it could not be queued
+};
+
+struct syscall_ring {
+    uint32_t sq_head; // Next entry the kernel runs
+    uint32_t sq_tail; // Next entry the process fills
+    uint32_t cq_head; // Next completion the process reads
+    uint32_t cq_tail; // Next completion the kernel fills
+    struct syscall_sqe sq[RING_ENTRIES];
+    struct syscall_cqe cq[RING_ENTRIES];
+};
+
+/* Kernel side, see entry.S and syscall.c */
+void syscall_entry(void);
+void sysenter_entry(void);
+int system_call_helper(int fn, uint32_t arg1, uint32_t arg2, uint32_t arg3,
+                       uint32_t arg4, uint32_t arg5);
+int do_ring_enter(struct syscall_ring* ring);
+
+/*
+ * Points the sysenter MSRs at sysenter_entry. kernel_cs is the kernel
+ * code selector, sysexit uses kernel_cs + 16 and kernel_cs + 24 for the
+ * user code and data segments, so the GDT must have them in that order.
+ * Returns 0 if the CPU does not have sysenter, processes then keep using
+ * the int path.
+ * _start() must call init_sysenter(KERNEL_CS) once the GDT is loaded,
+ * until then processes use the int path as well. On success it sets
+ * sysenter_ready, which update_kdata() copies to the kernel data page.
+ */
+int init_sysenter(uint32_t kernel_cs);
+extern int sysenter_ready;
+
+/*
+ * User side. The number goes in %eax and the arguments in %ebx, %ecx,
+ * %edx, %esi and %edi, unused ones are ignored by the handler.
+ * The sysenter stub pushes the return address and hands the kernel its
+ * stack in %ebp, sysexit puts it back in %ecx and the return address in
+ * %edx, so both are clobbered. Only processes may use it, threads run
+ * in the kernel and call the functions directly.
+ * sysenter is only used when the kernel data page says init_sysenter()
+ * has run. The cpu having it is not enough, the MSRs are zero until then.
+ */
+static inline bool_t has_sysenter(void) {
+    return ((const volatile struct kernel_data *)KDATA_ADDR)->sysenter != 0;
+}
+
+static inline int invoke_syscall(int i, uint32_t arg1, uint32_t arg2, uint32_t arg3,
+                                 uint32_t arg4, uint32_t arg5) {
+    int ret;
+    if(has_sysenter()) {
+        asm volatile("pushl %%ebp\n\t"
+                     "pushl $1f\n\t"
+                     "movl %%esp, %%ebp\n\t"
+                     "sysenter\n"
+                     "1:\n\t"
+                     "addl $4, %%esp\n\t"
+                     "popl %%ebp"
+                     : "=a"(ret), "+c"(arg2), "+d"(arg3)
+                     : "a"(i), "b"(arg1), "S"(arg4), "D"(arg5)
+                     : "memory");
+    } else {
+        asm volatile("int %2"
+                     : "=a"(ret)
+                     : "a"(i), "i"(IDT_SYSCALL_POS), "b"(arg1), "c"(arg2), "d"(arg3),
+                       "S"(arg4), "D"(arg5)
+                     : "memory");
+    }
+    return ret;
+}
+
+/* Queues a call on ring, returns -1 if the submission ring is full */
+static inline int ring_queue(struct syscall_ring* ring, int fn, uint32_t user_data,
+                             uint32_t arg1, uint32_t arg2, uint32_t arg3) {
+    if(ring->sq_tail - ring->sq_head >= RING_ENTRIES) {
+        return -1;
+    }
+    struct syscall_sqe* sqe = &ring->sq[ring->sq_tail % RING_ENTRIES];
+    sqe->fn = fn;
+    sqe->args[0] = arg1;
+    sqe->args[1] = arg2;
+    sqe->args[2] = arg3;
+    sqe->args[3] = 0;
+    sqe->args[4] = 0;
+    sqe->user_data = user_data;
+    ring->sq_tail++;
+    return 0;
+}
+
+/* Runs the queued calls, returns how many were run */
+static inline int ring_enter(struct syscall_ring* ring) {
+    return invoke_syscall(SYSCALL_RING_ENTER, (uint32_t)ring, 0, 0, 0, 0);
+}
+
+#endif /* !SYSCALL_H */
@@ -2,11 +2,80 @@
  * memory.c
  *
  * Note:
- * There is no separate swap area. When a data page is swapped out, it is
- * stored in the location it was loaded from in the process' image. This means
- * it's impossible to start two processes from the same image without messing
- * up the already executing process. It also means that we cannot use the
- * program disk anymore.
+ * Dirty pages are written to a separate swap area placed right after the
+ * filesystem on the disk, so the process images are never modified and
+ * several processes can be started from the same image. A swapped out page
+ * keeps its swap slot in the (not present) page table entry, marked with
+ * PE_SWAP. Clean pages that were never swapped are just dropped, and read
+ * from the process image again on the next fault.
+ *
+ * Image pages are kept in a page cache, keyed by their location on disk,
+ * and mapped copy-on-write into every process started from that image.
+ * The mappings are read-only and marked with PE_COW, the first write to
+ * one gives the process its own private copy (or the page itself, if no
+ * other process is using it). cr0.WP is set, so the kernel writing into
+ * user memory (fs_read, mbox_recv, ...) faults and gets a copy the same way
+ * instead of changing the cached page under every process. The kernel
+ * must not write user memory while holding memory_lock.
+ *
+ * A fault on an image page also maps the neighbouring pages that are already
+ * in the page cache (fault-around), and processes that fault sequentially
+ * get the following pages read with the same scsi_read (read ahead).
+ *
+ * memory_lock is not held during disk I/O. A block being read or written is
+ * marked in_transit, which keeps it from being evicted or used, and anyone
+ * else needing the page waits on the io_done condition of the block.
+ *
+ * The page_cleaner thread writes dirty pages back to swap in the background,
+ * so the replacement policy can usually find a clean page to evict.
+ * It also keeps a small pool of zeroed free blocks, pages that are read
+ * from disk are not zeroed at all. It sleeps on cleaner_wake, which
+ * get_memory() signals when it runs the free lists low and the timer
+ * signals every CLEANER_TICKS ticks.
+ *
+ * The kernel region is mapped with static page tables that the kernel and
+ * every process share, so the screen can be given to user mode. Their
+ * entries are global when the cpu supports it, and there is only one
+ * translation for each address. None of this uses pageable blocks, and the
+ * kernel TLB entries survive switching between processes.
+ *
+ * Page tables for the process image are made on the first fault in their
+ * range, and are not pinned. A table with no present or swapped out
+ * entries can be evicted like a page, it is just dropped and made again
+ * on the next fault.
+ *
+ * Only the top page of the user stack is set up (and pinned) when a process
+ * is made. The stack grows down on faults, with zeroed pages, up to
+ * STACK_MAX_PAGES. The page below that is a guard page that is never mapped.
+ *
+ * The heap starts on the page after the image and is grown with do_sbrk().
+ * Heap pages are zeroed on the first fault, they are never read from disk.
+ *
+ * Files are mapped with do_mmap(). Their pages are read with db_read on
+ * the first fault, and dirty ones are written back with db_write when they
+ * are unmapped, never to the swap area. File pages are pinned, so the file
+ * is only read and written by the process that mapped it, from its own
+ * faults and unmaps, like fs_read and fs_write, and never by another
+ * process evicting the page.
+ *
+ * The page cleaner also samples the accessed bits into a history kept
+ * beside the age of every block, and estimates the working set of each
+ * process from it, counting shared pages once. When the working sets do
+ * not fit and processes keep faulting, the newest process is suspended:
+ * all its pages are evicted or unmapped, and it waits in
+ * page_fault_handler until the others leave room for it again, or for at
+ * most SUSPEND_TICKS, see control_load().
+ *
+ * The pageable memory is the usable RAM from 1MB up to the end of the
+ * kernel region (MAX_PHYSICAL_MEMORY, 12MB), found in the E820 map the
+ * boot block leaves at E820_MAP. The table of memory blocks is put at the
+ * start of it, and the blocks follow. MEMORY_MODE = MEMORY_STRESS limits
+ * it to STRESS_PAGES blocks, as does a missing E820 map.
+ *
+ * The kernel data page (struct kernel_data) is a page of the kernel image.
+ * setup_page_table() maps it read-only at KDATA_ADDR in every process, so
+ * processes read the time and their pid from it without a syscall. The
+ * kernel writes it through the kernel region, where it is supervisor only.
  *
  * Best viewed with tabs set to 4 spaces.
  */
@@ -19,10 +88,22 @@
 #include "util.h"
 #include "interrupt.h"
 #include "tlb.h"
+#include "syscall.h"
 #include "usb/scsi.h"
 #include "usb/error.h"
 #include "usb/debug.h"
+#include "fs.h"
 
+extern const int os_size;
+
+
+/* Memory Mapped file status struct, see do_mmap() */
+struct MMS {
+    int inode; // Inode of the file, -1 if the mapping is unused
+    uint32_t vaddr; // First address of the mapping
+    uint32_t size; // Bytes of the file that are mapped
+    bool_t writable; // If the file was opened for writing
+};
 
 /* Physical Memory status struct
  * contains information about physical memory blocks
@@ -30,14 +111,96 @@
 struct PMS {
     uint32_t vaddr; // Current Virtual Address
     uint32_t paddr; // Physical Address
-    pcb_t pcb; // The pcb that uses this block
+    pcb_t* pcb; // The pcb that owns this block
     bool_t pinned; // If the memory block is pinned and unswappable
+    uint8_t age; // Aging counter, msb is set when the page was referenced last sweep
+    uint8_t history; // Accessed bit samples for the working set, msb is the last one
+    bool_t sampled; // Referenced bit taken by sample_working_sets(), not yet seen by the replacement
+    int refcount; // Number of users of this block, 0 when it is free
+    int next_free; // Next block in the free list
+    int swap_slot; // Swap slot holding a copy of this page, -1 if none
+    uint32_t cache_loc; // Image location of a shared page, 0 if private
+    bool_t in_transit; // If the block is being read or written to disk
+    condition_t io_done; // Signaled when disk I/O on the block is done
+    bool_t is_table; // If the block holds a page table of the process
+    struct MMS* file; // Mapping of a memory mapped file page, NULL if none
+    bool_t read_ahead; // If the page was read ahead and has not been used yet
+    uint32_t* pte; // Page table entry mapping a private page in its owner, NULL if none
+};
+struct PMS* memoryblocks;
+/* Number of memory blocks, and the address of the first one */
+static int pageable_pages;
+static uint32_t blocks_start;
+
+/* Memory map entry from the BIOS (int 0x15, eax 0xe820), see bootblock.s */
+struct e820_entry {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t acpi;
+} __attribute__((packed));
+
+/* Virtual Memory status struct
+ * contains information about the address space of a process
+ */
+struct VMS {
+    pcb_t* pcb; // The process using this address space, NULL if unused
+    uint32_t next_fault; // Address right after the pages read on the last fault
+    int window; // Number of pages to read ahead on the next sequential fault
+    uint32_t brk; // End of the heap, see do_sbrk()
+    struct MMS maps[MAX_MAPPINGS]; // Memory mapped files
+    int working_set; // Pages used in the last samples, see sample_working_sets()
+    bool_t suspended; // If the process is swapped out by control_load()
+    uint32_t suspended_at; // Tick it was last suspended
+    uint32_t resumed_at; // Tick it was last let back in, 0 if never
 };
-struct PMS memoryblocks[PAGEABLE_PAGES];
+static struct VMS address_spaces[MAX_ADDRESS_SPACES];
+
+/* Paging statistics, see get_paging_stats() */
+static struct paging_stats stats;
+
+/* The kernel data page, a whole page so nothing else is shown to processes */
+static union {
+    struct kernel_data data;
+    char page[PAGE_SIZE];
+} kdata_page __attribute__((aligned(PAGE_SIZE)));
+
+/* Timer ticks since boot, only the low half, it is written by the timer interrupt */
+static inline uint32_t get_ticks(void) {
+    return (uint32_t)kdata_page.data.ticks;
+}
 
 /* Contains "kernel" paging */
 static pcb_t kernel;
+/* Page tables for the kernel region, shared by every process */
+static uint32_t kernel_tables[N_KERNEL_PTS][PAGE_N_ENTRIES] __attribute__((aligned(PAGE_SIZE)));
 #define PROCESS_ENTRY 0x1000000
+/* Top page of the user stack, and the guard page below the largest stack */
+#define STACK_TOP (PROCESS_STACK & PE_BASE_ADDR_MASK)
+#define STACK_GUARD (STACK_TOP - (STACK_MAX_PAGES * PAGE_SIZE))
+/* The kernel region is shared by every process, the stack and image can not be in it */
+_Static_assert(STACK_GUARD >= MAX_PHYSICAL_MEMORY, "user stack overlaps the kernel region");
+_Static_assert(PROCESS_STACK >= MAX_PHYSICAL_MEMORY, "user stack overlaps the kernel region");
+_Static_assert(PROCESS_ENTRY >= MAX_PHYSICAL_MEMORY, "process image overlaps the kernel region");
+/* The kernel data page is mapped in the table of the stack */
+_Static_assert(KDATA_ADDR > STACK_TOP && KDATA_ADDR < PROCESS_ENTRY
+               && (KDATA_ADDR >> PAGE_DIRECTORY_BITS) == (PROCESS_STACK >> PAGE_DIRECTORY_BITS),
+               "kernel data page is not next to the stack");
+/* Memory mapped files, mapping m starts at MMAP_START + m * MMAP_SPAN,
+ * a mapping holds the largest file the filesystem has */
+#define MMAP_START 0x40000000
+#define MMAP_MAX_PAGES ((MAX_FILESIZE + PAGE_SIZE - 1) / PAGE_SIZE)
+#define MMAP_SPAN (MMAP_MAX_PAGES * PAGE_SIZE)
+
+/* Regions of a process address space, see get_region() */
+enum {
+    REGION_NONE,
+    REGION_IMAGE,
+    REGION_STACK,
+    REGION_GUARD,
+    REGION_HEAP,
+    REGION_FILE,
+};
 static lock_t memory_lock;
 
 /* Use virtual address to get index in page directory.  */
@@ -56,18 +219,120 @@ static inline uint32_t get_table_index(uint32_t vaddr)
 {
     return (vaddr & PAGE_TABLE_MASK) >> PAGE_TABLE_BITS;
 }
+/* Pending TLB flushes, done by flush_tlb() */
+static uint32_t tlb_batch[TLB_BATCH];
+static int tlb_pending = 0;
+
+/* Returns the page directory loaded in cr3 */
+static inline uint32_t* current_directory(void)
+{
+    uint32_t cr3;
+    asm volatile ("movl %%cr3, %0" : "=r" (cr3));
+    return (uint32_t*)(cr3 & PE_BASE_ADDR_MASK);
+}
+
+/* Adds the time since start (from get_timer) to a latency histogram.
+ * Bucket 0 counts times below 2^LATENCY_SHIFT cycles, each following
+ * bucket twice as long times, and the last one everything above.
+ */
+static void record_latency(uint32_t* histogram, uint64_t start) {
+    uint64_t cycles = (get_timer() - start) >> LATENCY_SHIFT;
+    int bucket = 0;
+    while(cycles > 0 && bucket < LATENCY_BUCKETS - 1) {
+        cycles >>= 1;
+        bucket++;
+    }
+    histogram[bucket]++;
+}
+
+/* Returns the cpuid feature flags (edx of leaf 1) */
+static inline uint32_t cpu_features(void)
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile ("cpuid" : "+a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx));
+    return edx;
+}
+
+/* Sets bits in cr0 */
+static inline void set_cr0(uint32_t bits)
+{
+    asm volatile ("movl %%cr0, %%eax\n\t"
+                  "orl %0, %%eax\n\t"
+                  "movl %%eax, %%cr0"
+                  :: "r" (bits) : "eax");
+}
+
+/* Sets bits in cr4 */
+static inline void set_cr4(uint32_t bits)
+{
+    asm volatile ("movl %%cr4, %%eax\n\t"
+                  "orl %0, %%eax\n\t"
+                  "movl %%eax, %%cr4"
+                  :: "r" (bits) : "eax");
+}
+
+/* Loads a page directory into cr3, which flushes the non-global TLB entries */
+static inline void load_directory(uint32_t* directory)
+{
+    asm volatile ("movl %0, %%cr3" :: "r" (directory) : "memory");
+}
+
+/* Flushes the TLB by loading cr3 again, global entries are kept */
+static inline void reload_directory(void)
+{
+    asm volatile ("movl %%cr3, %%eax\n\t"
+                  "movl %%eax, %%cr3"
+                  ::: "eax", "memory");
+}
+
  /* Updates a entry in a page table or directory
+ * The TLB is not flushed here, the address is queued and flushed by
+ * flush_tlb() before memory_lock is released.
  * params:
+ *   uint32_t* directory : page directory the table belongs to
  *   uint32_t* table : the table or directory to update
  *   uint32_t index : index in table/directory
  *   uint32_t vaddr : Virtual Address
  *   uint32_t paddr : Physical Address
  *   uint32_t flags : The new bit flags for the entry
  */
-void update_entry(uint32_t* table, uint32_t index, uint32_t vaddr,
+void update_entry(uint32_t* directory, uint32_t* table, uint32_t index, uint32_t vaddr,
                   uint32_t paddr, uint32_t flags) {
+    uint32_t old = table[index];
     table[index] = (paddr & PE_BASE_ADDR_MASK) | (flags & MODE_MASK);
-    flush_tlb_entry(vaddr);
+    // The cpu never caches entries that are not present, and loading another
+    // directory flushes the TLB anyway. The kernel tables are in every directory.
+    if((old & PE_P) == 0
+       || (directory != current_directory() && directory != kernel.page_directory)) {
+        return;
+    }
+    if(tlb_pending < TLB_BATCH) {
+        tlb_batch[tlb_pending] = vaddr;
+    }
+    tlb_pending++;
+}
+
+/* Does the TLB flushes queued by update_entry(). A few pages are flushed
+ * one by one, if there are more than fit in the batch the whole TLB is
+ * flushed.
+ */
+static void flush_tlb(void) {
+    if(tlb_pending > TLB_BATCH) {
+        reload_directory();
+    } else {
+        for(int n = 0; n < tlb_pending; n++) {
+            flush_tlb_entry(tlb_batch[n]);
+        }
+    }
+    tlb_pending = 0;
+}
+
+/* Releases memory_lock, the queued TLB flushes are done first so nobody
+ * runs with a stale TLB entry
+ */
+static void memory_unlock(void) {
+    flush_tlb();
+    lock_release(&memory_lock);
 }
 
 /* Returns a entry in a page table, the location and sectors for the USB-Drive
@@ -94,83 +359,644 @@ uint32_t* get_entry_and_location(uint32_t vaddr, pcb_t* pcb, uint32_t* location,
         return entry;
 }
 
-/* counts how many blocks we have allocated */
-static uint32_t allocated = 0;
+/* First block in the list of free memory blocks, -1 if empty */
+static int free_list = -1;
+/* Free blocks that are already zeroed, filled by page_cleaner() */
+static int zero_list = -1;
+static int zero_count = 0;
 
-/* Allocates a new memory block if we have free memory / pageable pages
- * If not it will swap out a unpinned pageable page
+/* Swap area, one bit per slot, a slot holds one page */
+static uint8_t swap_bmap[SWAP_SLOTS / 8];
+/* First sector of the swap area */
+static uint32_t swap_start;
+
+/* Returns the index of the memory block at a physical address */
+static inline uint32_t get_block_index(uint32_t paddr) {
+    return (paddr - blocks_start) / PAGE_SIZE;
+}
+
+/* Maps a private memory block into its owner and remembers the entry,
+ * so eviction can find it without walking the page directory
  * params:
- *   bool_t pinned : If the block should be pinned
- *   uint32_t vaddr : Virtual Address for the block
- *   pcb_t pcb : PCB that takes ownership of the block
- * returns: uint32_t physical address for the memory block
+ *   uint32_t paddr : Physical Address of the block
+ *   uint32_t* table : page table to map it in
+ *   uint32_t index : index in table
+ *   uint32_t flags : flags of the entry
  */
-uint32_t get_memory(bool_t pinned, uint32_t vaddr, pcb_t pcb) {
-    uint32_t i = allocated;
-    if(allocated < PAGEABLE_PAGES) {
-        uint32_t addr = MEM_START + (allocated * PAGE_SIZE);
-        memoryblocks[i].paddr = addr;
-        allocated++;
-    } else {
-        uint32_t unpinned[PAGEABLE_PAGES];
-        int counter = 0;
-        for(int i = 0; i < PAGEABLE_PAGES; i++) {
-            if(memoryblocks[i].pinned == FALSE) {
-                unpinned[counter] = i;
-                counter++;
+static void map_block(uint32_t paddr, uint32_t* table, uint32_t index, uint32_t flags) {
+    uint32_t i = get_block_index(paddr);
+    memoryblocks[i].pte = &table[index];
+    update_entry(memoryblocks[i].pcb->page_directory, table, index, memoryblocks[i].vaddr, paddr, flags);
+}
+
+/* Returns the first sector of a swap slot */
+static inline uint32_t get_swap_location(int slot) {
+    return swap_start + (slot * SECTORS_PER_PAGE);
+}
+
+/* Allocates a swap slot
+ * returns: the slot, or -1 if the swap area is full
+ */
+static int alloc_swap_slot(void) {
+    for(int i = 0; i < SWAP_SLOTS / 8; i++) {
+        if(swap_bmap[i] == 0xff) { // All taken
+            continue;
+        }
+        for(int bit = 0; bit < 8; bit++) {
+            if((swap_bmap[i] & (1 << bit)) == 0) {
+                swap_bmap[i] |= (1 << bit);
+                return (i * 8) + bit;
             }
         }
-        if(counter == 0) {
-            scrprintf(0,40,"PID %i : No unpinned memory free", pcb.pid);
-            lock_release(&memory_lock);
-            exit();
-            return 0;
+    }
+    return -1;
+}
+
+/* Gives back a swap slot */
+static void free_swap_slot(int slot) {
+    swap_bmap[slot / 8] &= ~(1 << (slot % 8));
+}
+
+/* Next block the page replacement will look at */
+static uint32_t clock_hand = 0;
+/* Signaled when a process suspended by control_load() can run again */
+static condition_t admitted;
+/* Signaled when the page cleaner has work, see page_cleaner() */
+static condition_t cleaner_wake;
+
+/* First address of the heap, the page after the image */
+static inline uint32_t get_heap_start(pcb_t* p) {
+    return PROCESS_ENTRY + ((p->swap_size * SECTOR_SIZE + PAGE_SIZE - 1) & PE_BASE_ADDR_MASK);
+}
+
+/* Registers the address space of a process
+ * returns: the entry, or NULL if the table is full
+ */
+static struct VMS* add_vms(pcb_t* p) {
+    for(int v = 0; v < MAX_ADDRESS_SPACES; v++) {
+        if(address_spaces[v].pcb == NULL) {
+            address_spaces[v].pcb = p;
+            // Processes start by running their image from the top
+            address_spaces[v].next_fault = PROCESS_ENTRY;
+            address_spaces[v].window = 0;
+            address_spaces[v].brk = get_heap_start(p);
+            address_spaces[v].working_set = 0;
+            address_spaces[v].suspended = FALSE;
+            address_spaces[v].resumed_at = 0;
+            for(int m = 0; m < MAX_MAPPINGS; m++) {
+                address_spaces[v].maps[m].inode = -1;
+                address_spaces[v].maps[m].vaddr = MMAP_START + (m * MMAP_SPAN);
+            }
+            return &address_spaces[v];
+        }
+    }
+    return NULL;
+}
+
+/* Returns the address space entry of a process, NULL if it has none */
+static struct VMS* get_vms(pcb_t* p) {
+    for(int v = 0; v < MAX_ADDRESS_SPACES; v++) {
+        if(address_spaces[v].pcb == p) {
+            return &address_spaces[v];
+        }
+    }
+    return NULL;
+}
+
+/* Returns the file mapping a page belongs to, NULL if none */
+static struct MMS* get_file_mapping(struct VMS* vms, uint32_t vaddr) {
+    for(int m = 0; m < MAX_MAPPINGS; m++) {
+        struct MMS* map = &vms->maps[m];
+        if(map->inode >= 0 && vaddr >= map->vaddr && vaddr < map->vaddr + map->size) {
+            return map;
+        }
+    }
+    return NULL;
+}
+
+/* Finds the region of a process address space a page belongs to
+ * params:
+ *   pcb_t* pcb : the process
+ *   uint32_t vaddr : page aligned Virtual Address
+ */
+static int get_region(pcb_t* pcb, uint32_t vaddr) {
+    if(vaddr >= PROCESS_ENTRY && vaddr < PROCESS_ENTRY + (pcb->swap_size * SECTOR_SIZE)) {
+        return REGION_IMAGE;
+    }
+    if(vaddr > STACK_GUARD && vaddr <= STACK_TOP) {
+        return REGION_STACK;
+    }
+    if(vaddr == STACK_GUARD) {
+        return REGION_GUARD;
+    }
+    struct VMS* vms = get_vms(pcb);
+    if(vms != NULL && vaddr >= get_heap_start(pcb) && vaddr < vms->brk) {
+        return REGION_HEAP;
+    }
+    if(vms != NULL && get_file_mapping(vms, vaddr) != NULL) {
+        return REGION_FILE;
+    }
+    return REGION_NONE;
+}
+
+/* Returns the page table a memory block is mapped in by a process
+ * params:
+ *   uint32_t i : index of the memory block
+ *   pcb_t* p : the process
+ *   uint32_t* index : uint32_t to write the index in the table to
+ * returns: the page table, or NULL if the process does not map the block
+ */
+static uint32_t* get_mapping(uint32_t i, pcb_t* p, uint32_t* index) {
+    // Private pages remember their entry, no need to walk the directory
+    uint32_t* pte = memoryblocks[i].pte;
+    if(pte != NULL && p == memoryblocks[i].pcb) {
+        if((*pte & PE_P) == 0 || (*pte & PE_BASE_ADDR_MASK) != memoryblocks[i].paddr) {
+            return NULL;
+        }
+        uint32_t* table = (uint32_t*)((uint32_t)pte & PE_BASE_ADDR_MASK);
+        *index = pte - table;
+        return table;
+    }
+    uint32_t dir_entry = p->page_directory[get_directory_index(memoryblocks[i].vaddr)];
+    if((dir_entry & PE_P) == 0) {
+        return NULL;
+    }
+    uint32_t* table = (uint32_t*)(dir_entry & PE_BASE_ADDR_MASK);
+    *index = get_table_index(memoryblocks[i].vaddr);
+    if((table[*index] & PE_P) == 0
+       || (table[*index] & PE_BASE_ADDR_MASK) != memoryblocks[i].paddr) {
+        return NULL;
+    }
+    return table;
+}
+
+/* Checks and clears the accessed bit of a memory block in one process
+ * returns: TRUE if the process referenced the page since the last check
+ */
+static bool_t clear_accessed(uint32_t i, pcb_t* p) {
+    uint32_t index;
+    uint32_t* table = get_mapping(i, p, &index);
+    if(table == NULL || (table[index] & PE_A) == 0) {
+        return FALSE;
+    }
+    // The TLB entry is flushed before memory_lock is released, so the cpu
+    // sets the bit again on next access
+    update_entry(p->page_directory, table, index, memoryblocks[i].vaddr, memoryblocks[i].paddr, table[index] & ~PE_A);
+    return TRUE;
+}
+
+/* Counts a read ahead page as used, the first time it is seen referenced */
+static void prefetch_used(uint32_t i) {
+    if(memoryblocks[i].read_ahead == TRUE) {
+        memoryblocks[i].read_ahead = FALSE;
+        stats.prefetch_hits++;
+    }
+}
+
+/* Checks and clears the accessed bit of the page in a memory block
+ * Shared pages are checked in every process that maps them.
+ * returns: TRUE if the page was referenced since the last check
+ */
+static bool_t test_and_clear_accessed(uint32_t i) {
+    if(memoryblocks[i].cache_loc == 0) {
+        return clear_accessed(i, memoryblocks[i].pcb);
+    }
+    bool_t referenced = FALSE;
+    for(int v = 0; v < MAX_ADDRESS_SPACES; v++) {
+        if(address_spaces[v].pcb != NULL && clear_accessed(i, address_spaces[v].pcb)) {
+            referenced = TRUE;
+        }
+    }
+    // Read ahead pages are mapped right away, the accessed bit tells if they were used
+    if(referenced) {
+        prefetch_used(i);
+    }
+    return referenced;
+}
+
+/* Checks and clears if the page in a memory block was referenced, for the
+ * replacement. References the working set sampling took from the accessed
+ * bit count too.
+ */
+static bool_t was_referenced(uint32_t i) {
+    bool_t referenced = test_and_clear_accessed(i) || memoryblocks[i].sampled;
+    memoryblocks[i].sampled = FALSE;
+    return referenced;
+}
+
+/* Checks if the page in a memory block has been written to since it was
+ * last written to disk. Shared pages are never dirty.
+ */
+static bool_t is_dirty(uint32_t i) {
+    if(memoryblocks[i].cache_loc != 0) {
+        return FALSE;
+    }
+    uint32_t index;
+    uint32_t* table = get_mapping(i, memoryblocks[i].pcb, &index);
+    return table != NULL && (table[index] & PE_D) != 0;
+}
+
+/* Checks if a page table has no entries in use */
+static bool_t table_empty(uint32_t i) {
+    uint32_t* table = (uint32_t*)memoryblocks[i].paddr;
+    for(int t = 0; t < PAGE_N_ENTRIES; t++) {
+        if((table[t] & (PE_P | PE_SWAP)) != 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Checks if a memory block can be evicted. Page tables can only be
+ * evicted when they are empty, and private pages only when they are
+ * mapped. A block get_memory() just handed out is not mapped until its
+ * owner is done filling it, and memory_lock can be released before that.
+ */
+static bool_t can_evict(uint32_t i) {
+    if(memoryblocks[i].pinned == TRUE || memoryblocks[i].refcount == 0
+       || memoryblocks[i].in_transit == TRUE) {
+        return FALSE;
+    }
+    if(memoryblocks[i].is_table == TRUE) {
+        return table_empty(i);
+    }
+    uint32_t index;
+    return memoryblocks[i].cache_loc != 0 || get_mapping(i, memoryblocks[i].pcb, &index) != NULL;
+}
+
+/* Second chance (clock) replacement
+ * Sweeps from the clock hand, giving referenced pages a second chance by
+ * clearing their accessed bit. Two full sweeps are enough to find a victim.
+ * Clean pages are preferred, dirty ones are left for the page cleaner and
+ * only picked if there is no clean page to take.
+ * returns: index of the block to evict, or -1 if every block is pinned
+ */
+static int select_victim_clock(void) {
+    int dirty_victim = -1;
+    for(int n = 0; n < 2 * pageable_pages; n++) {
+        uint32_t i = clock_hand;
+        clock_hand = (clock_hand + 1) % pageable_pages;
+        if(can_evict(i) == FALSE) {
+            continue;
+        }
+        if(was_referenced(i) == FALSE) {
+            if(is_dirty(i) == FALSE) {
+                return i;
+            }
+            if(dirty_victim < 0) {
+                dirty_victim = i;
+            }
+        }
+    }
+    return dirty_victim;
+}
+
+/* Aging replacement (working set approximation)
+ * Every unpinned block gets its accessed bit shifted into an 8 bit counter,
+ * and the block with the lowest counter (least recently used) is picked.
+ * Ties are broken in clock order so equally old pages are rotated.
+ * returns: index of the block to evict, or -1 if every block is pinned
+ */
+static int select_victim_aging(void) {
+    int victim = -1;
+    for(int n = 0; n < pageable_pages; n++) {
+        uint32_t i = (clock_hand + n) % pageable_pages;
+        if(can_evict(i) == FALSE) {
+            continue;
+        }
+        memoryblocks[i].age >>= 1;
+        if(was_referenced(i) == TRUE) {
+            memoryblocks[i].age |= 0x80;
+        }
+        if(victim == -1 || memoryblocks[i].age < memoryblocks[victim].age) {
+            victim = i;
+        }
+    }
+    if(victim != -1) {
+        clock_hand = (victim + 1) % pageable_pages;
+    }
+    return victim;
+}
+
+/* Picks a block to evict with the configured replacement policy */
+static int select_victim(void) {
+    if(PAGE_REPLACEMENT == REPLACE_AGING) {
+        return select_victim_aging();
+    }
+    return select_victim_clock();
+}
+
+/* Marks a memory block as busy with disk I/O and releases memory_lock
+ * while the I/O is done. Must be followed by end_io().
+ */
+static void start_io(uint32_t i) {
+    memoryblocks[i].in_transit = TRUE;
+    memory_unlock();
+}
+
+/* Takes memory_lock back after disk I/O, and wakes up anyone waiting for it */
+static void end_io(uint32_t i) {
+    lock_acquire(&memory_lock);
+    memoryblocks[i].in_transit = FALSE;
+    condition_broadcast(&memoryblocks[i].io_done);
+}
+
+/* Waits until the disk I/O on a memory block is done,
+ * memory_lock is released while waiting
+ */
+static void wait_io(uint32_t i) {
+    while(memoryblocks[i].in_transit == TRUE) {
+        flush_tlb();
+        condition_wait(&memory_lock, &memoryblocks[i].io_done);
+    }
+}
+
+/* Waits for any memory block with disk I/O in progress
+ * returns: FALSE if there was nothing to wait for
+ */
+static bool_t wait_any_io(void) {
+    for(int i = 0; i < pageable_pages; i++) {
+        if(memoryblocks[i].in_transit == TRUE) {
+            wait_io(i);
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* Returns the block that is being written to a swap slot, -1 if none */
+static int find_swap_out(int slot) {
+    for(int i = 0; i < pageable_pages; i++) {
+        if(memoryblocks[i].in_transit == TRUE && memoryblocks[i].swap_slot == slot) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Drops a reference to a memory block, and puts it back in the free list
+ * when the last user is gone
+ * params:
+ *   uint32_t i : index of the memory block
+ */
+static void put_memory(uint32_t i) {
+    if(--memoryblocks[i].refcount > 0) {
+        return;
+    }
+    if(memoryblocks[i].swap_slot >= 0) {
+        free_swap_slot(memoryblocks[i].swap_slot);
+        memoryblocks[i].swap_slot = -1;
+    }
+    memoryblocks[i].pcb = NULL;
+    memoryblocks[i].pinned = FALSE;
+    memoryblocks[i].cache_loc = 0;
+    memoryblocks[i].next_free = free_list;
+    free_list = i;
+}
+
+/* Frees blocks still owned by processes that have exited.
+ * Exiting processes leave their page directory behind (see free_memory),
+ * it is safe to reuse once another task is running.
+ */
+static void reclaim_exited(void) {
+    for(int i = 0; i < pageable_pages; i++) {
+        pcb_t* owner = memoryblocks[i].pcb;
+        if(memoryblocks[i].refcount > 0 && owner != &kernel && memoryblocks[i].in_transit == FALSE
+           && owner->state == STATUS_EXITED && owner != current_running) {
+            put_memory(i);
+        }
+    }
+}
+
+/* Writes a page of a memory mapped file back to the file.
+ * memory_lock is released while the page is written.
+ */
+static void write_file_page(uint32_t i) {
+    struct MMS* map = memoryblocks[i].file;
+    uint32_t pos = (memoryblocks[i].vaddr & PE_BASE_ADDR_MASK) - map->vaddr;
+    uint32_t bytes = map->size - pos;
+    if(bytes > PAGE_SIZE) {
+        bytes = PAGE_SIZE;
+    }
+    stats.writebacks++;
+    start_io(i);
+    db_write(map->inode, (char*)memoryblocks[i].paddr, bytes, pos);
+    end_io(i);
+}
+
+/* Removes the page in a memory block from the address space of its owner.
+ * Dirty pages are written to their swap slot, clean pages are dropped
+ * and later read back from their swap slot or the image. File pages are
+ * pinned and never come here.
+ * The block must pass can_evict(), so a private page is mapped.
+ * memory_lock is released while a dirty page is written.
+ * params:
+ *   uint32_t i : index of the memory block
+ * returns: FALSE if the page is dirty and the swap area is full
+ */
+static bool_t swap_out(uint32_t i) {
+    uint32_t index;
+    uint32_t* table;
+    if(memoryblocks[i].is_table == TRUE) {
+        // Empty table, the next fault in its range makes a new one
+        uint32_t* directory = memoryblocks[i].pcb->page_directory;
+        update_entry(directory, directory, get_directory_index(memoryblocks[i].vaddr),
+                     memoryblocks[i].vaddr, 0, 0);
+        return TRUE;
+    }
+    if(memoryblocks[i].cache_loc != 0) {
+        // Shared pages are never written, drop them from every process
+        for(int v = 0; v < MAX_ADDRESS_SPACES; v++) {
+            if(address_spaces[v].pcb == NULL) {
+                continue;
+            }
+            table = get_mapping(i, address_spaces[v].pcb, &index);
+            if(table != NULL) {
+                update_entry(address_spaces[v].pcb->page_directory, table, index, memoryblocks[i].vaddr, 0, 0);
+            }
+        }
+        memoryblocks[i].cache_loc = 0;
+        return TRUE;
+    }
+
+    table = get_mapping(i, memoryblocks[i].pcb, &index);
+    int slot = memoryblocks[i].swap_slot;
+    int dirty = table[index] & PE_D;
+    if(dirty && slot < 0) {
+        slot = alloc_swap_slot();
+        if(slot < 0) {
+            return FALSE;
         }
+    }
 
-        // Get a random block from unpinned blocks
-        srand(get_timer());
-        uint32_t r = rand() % counter;
-        i = unpinned[r];
+    // Unmap before writing, so the owner cant change the page underneath us
+    if(slot < 0) {
+        update_entry(memoryblocks[i].pcb->page_directory, table, index, memoryblocks[i].vaddr, 0, 0);
+    } else {
+        update_entry(memoryblocks[i].pcb->page_directory, table, index, memoryblocks[i].vaddr,
+                     slot << PE_BASE_ADDR_BITS, (PE_SWAP | PE_RW | PE_US));
+    }
+    if(dirty) {
+        // The owner waits for this in page_fault_handler if it wants the page back
+        memoryblocks[i].swap_slot = slot;
+        stats.writebacks++;
+        start_io(i);
+        scsi_write(get_swap_location(slot), SECTORS_PER_PAGE, (void*)memoryblocks[i].paddr);
+        end_io(i);
+    }
+    // The slot now belongs to the page table entry
+    memoryblocks[i].swap_slot = -1;
+    return TRUE;
+}
 
-        uint32_t location;
-        uint32_t sectors;
-        uint32_t* entry = get_entry_and_location(memoryblocks[i].vaddr, &memoryblocks[i].pcb, &location, &sectors);
-        uint32_t index = get_table_index(memoryblocks[i].vaddr);
-        int dirty = entry[index] & PE_D;
-        // Reset flags for the task that was using this page.
-        // Since we are doing this completly random we might remove a page current task is using :(
-        // We can just reset all flags since we set them all when we add
-        update_entry(entry,index, memoryblocks[i].vaddr, memoryblocks[i].paddr, 0);
+/* Takes a block from the free lists. Blocks that must be zeroed come
+ * from the zeroed pool first, the others leave the pool alone if they can.
+ * params:
+ *   bool_t zero : If the block is going to be zeroed
+ *   bool_t* zeroed : Set to TRUE if the block is already zeroed
+ * returns: index of the block, or -1 if both lists are empty
+ */
+static int take_free(bool_t zero, bool_t* zeroed) {
+    int i;
+    if(zero_list >= 0 && (zero == TRUE || free_list < 0)) {
+        i = zero_list;
+        zero_list = memoryblocks[i].next_free;
+        zero_count--;
+        *zeroed = TRUE;
+        return i;
+    }
+    if(free_list >= 0) {
+        i = free_list;
+        free_list = memoryblocks[i].next_free;
+        *zeroed = FALSE;
+        return i;
+    }
+    return -1;
+}
 
-        if(dirty) {
-            // Write page to file
-            scsi_write(location, sectors, (void*)memoryblocks[i].paddr);
+/* Allocates a memory block like get_memory(), but leaves it to the caller
+ * to give up when there is no memory. For callers that hold blocks they
+ * must let go of before the process is killed.
+ * returns: uint32_t physical address for the memory block, 0 if there is
+ *          none (the reason is already on the screen)
+ */
+static uint32_t alloc_memory(bool_t pinned, bool_t zero, uint32_t vaddr, pcb_t* pcb) {
+    int i;
+    bool_t zeroed = FALSE;
+    while(1) {
+        if(free_list < 0 && zero_list < 0) {
+            reclaim_exited();
+        }
+        i = take_free(zero, &zeroed);
+        if(i >= 0) {
+            break;
+        }
+        int victim = select_victim();
+        if(victim >= 0) {
+            i = victim;
+            stats.evictions++;
+            if(swap_out(i) == FALSE) {
+                scrprintf(0,40,"PID %i : Swap area full", pcb->pid);
+                return 0;
+            }
+            break;
+        }
+        // Blocks busy with disk I/O become available when it is done
+        stats.no_victim++;
+        if(wait_any_io() == FALSE) {
+            scrprintf(0,40,"PID %i : No unpinned memory free", pcb->pid);
+            return 0;
         }
     }
     memoryblocks[i].pcb = pcb;
+    memoryblocks[i].refcount = 1;
+    memoryblocks[i].swap_slot = -1;
+    memoryblocks[i].cache_loc = 0;
+    memoryblocks[i].is_table = FALSE;
+    memoryblocks[i].file = NULL;
+    memoryblocks[i].read_ahead = FALSE;
+    memoryblocks[i].pte = NULL;
     memoryblocks[i].pinned = pinned;
     memoryblocks[i].vaddr = vaddr;
-    bzero(memoryblocks[i].paddr, PAGE_SIZE);
+    // A new page has just been referenced, dont make it the next victim
+    memoryblocks[i].age = 0x80;
+    memoryblocks[i].history = 0x80;
+    memoryblocks[i].sampled = FALSE;
+    if(zero == TRUE && zeroed == FALSE) {
+        uint64_t start = get_timer();
+        bzero(memoryblocks[i].paddr, PAGE_SIZE);
+        record_latency(stats.zero_time, start);
+    }
+    // Below the low-water mark, let the cleaner refill before we have to evict
+    if(free_list < 0 || zero_count < ZERO_POOL) {
+        condition_signal(&cleaner_wake);
+    }
     return memoryblocks[i].paddr;
 }
 
+/* Allocates a memory block from the free list if there is one
+ * If not it will swap out a unpinned pageable page
+ * The process is killed if there is no memory to be had.
+ * params:
+ *   bool_t pinned : If the block should be pinned
+ *   bool_t zero : If the page must be zeroed, pages that are about to be
+ *                 filled from disk or copied into dont need it
+ *   uint32_t vaddr : Virtual Address for the block
+ *   pcb_t* pcb : PCB that takes ownership of the block
+ * returns: uint32_t physical address for the memory block
+ */
+uint32_t get_memory(bool_t pinned, bool_t zero, uint32_t vaddr, pcb_t* pcb) {
+    uint32_t page = alloc_memory(pinned, zero, vaddr, pcb);
+    if(page == 0) {
+        memory_unlock();
+        exit();
+    }
+    return page;
+}
+
 /* create_table
  * creates a new table if one does not exist, otherwise updates and returns existing table
+ * Tables of the kernel are pinned, tables of processes can be evicted when empty.
  * params:
  *   uint32_t addr : Virtual Address
- *   pcb_t pcb : PCB it belongs to
+ *   pcb_t* pcb : PCB it belongs to
  *   uint32_t flags : Flags for table
  * returns: uint32_t the table
  */
-uint32_t create_table(uint32_t addr, pcb_t pcb, uint32_t flags) {
+uint32_t create_table(uint32_t addr, pcb_t* pcb, uint32_t flags) {
     uint32_t index = get_directory_index(addr);
-    uint32_t table = pcb.page_directory[index];
+    uint32_t table = pcb->page_directory[index];
     if((table & PE_P) == 0) {
-        table = get_memory(TRUE, addr, kernel);
+        table = get_memory(pcb == &kernel, TRUE, addr, pcb);
+        memoryblocks[get_block_index(table)].is_table = TRUE;
     }
-    update_entry(pcb.page_directory, index, addr, table, flags);
+    update_entry(pcb->page_directory, pcb->page_directory, index, addr, table, flags);
     return table;
 }
+
+/* Finds the pages of usable RAM from MEM_START up to MAX_PHYSICAL_MEMORY
+ * in the E820 map, the block table included. Warns if the BIOS gave no map.
+ * returns: number of pages, 0 if there is no map
+ */
+static uint32_t detect_memory(void) {
+    uint16_t count = *(uint16_t*)E820_MAP;
+    struct e820_entry* map = (struct e820_entry*)(E820_MAP + 4);
+    uint32_t end = MEM_START;
+    for(int e = 0; e < count && e < E820_MAX_ENTRIES; e++) {
+        if(map[e].type != E820_USABLE || map[e].base > MEM_START
+           || map[e].base + map[e].length <= MEM_START) {
+            continue;
+        }
+        uint64_t limit = map[e].base + map[e].length;
+        end = limit > MAX_PHYSICAL_MEMORY ? MAX_PHYSICAL_MEMORY : (uint32_t)limit;
+    }
+    if(end == MEM_START) {
+        scrprintf(0,30,"No E820 memory map, using %d pages", STRESS_PAGES);
+        return 0;
+    }
+    return (end - MEM_START) / PAGE_SIZE;
+}
+
 /*
  * init_memory()
  *
@@ -180,23 +1006,70 @@ uint32_t create_table(uint32_t addr, pcb_t pcb, uint32_t flags) {
 void init_memory(void)
 {
     lock_init(&memory_lock);
-    kernel.page_directory = get_memory(TRUE, 0, kernel);
+    condition_init(&admitted);
+    condition_init(&cleaner_wake);
+    // Detected memory also holds the block table, STRESS_PAGES are all blocks
+    uint32_t detected = 0;
+    if(MEMORY_MODE == MEMORY_DETECT) {
+        detected = detect_memory();
+    }
+    uint32_t pages = detected > 0 ? detected : STRESS_PAGES;
+    // The block table takes the first pages, the blocks get the rest
+    uint32_t table_pages = (pages * sizeof(struct PMS) + PAGE_SIZE - 1) / PAGE_SIZE;
+    memoryblocks = (struct PMS*)MEM_START;
+    blocks_start = MEM_START + (table_pages * PAGE_SIZE);
+    pageable_pages = pages;
+    if(detected > 0) {
+        pageable_pages -= table_pages;
+    }
+    // Put every block in the free list, lowest address first
+    for(int i = pageable_pages - 1; i >= 0; i--) {
+        memoryblocks[i].paddr = blocks_start + (i * PAGE_SIZE);
+        memoryblocks[i].refcount = 0;
+        memoryblocks[i].swap_slot = -1;
+        memoryblocks[i].cache_loc = 0;
+        memoryblocks[i].in_transit = FALSE;
+        memoryblocks[i].is_table = FALSE;
+        condition_init(&memoryblocks[i].io_done);
+        memoryblocks[i].next_free = free_list;
+        free_list = i;
+    }
+    // The swap area starts after the boot block, kernel and filesystem
+    swap_start = 2 + os_size + FS_BLOCKS;
+    bzero((char*)swap_bmap, sizeof(swap_bmap));
+
+    // Kernel writes to read-only user pages fault, so copy-on-write holds for them too
+    set_cr0(CR0_WP);
+
+    // Global pages are not flushed when cr3 is loaded
+    uint32_t global = 0;
+    if((cpu_features() & CPUID_PGE) != 0) {
+        set_cr4(CR4_PGE);
+        global = PE_G;
+    }
+
+    kernel.page_directory = get_memory(TRUE, TRUE, 0, &kernel);
     uint32_t paddr = 0;
     for(int i = 0; i < N_KERNEL_PTS; i++) {
-        uint32_t table = create_table(paddr, kernel, (PE_P | PE_RW));
+        uint32_t* table = kernel_tables[i];
+        uint32_t vaddr = paddr;
         for(int x = 0; x < PAGE_N_ENTRIES; x++) {
             uint32_t index = get_table_index(paddr);
             //Set video memory access for processes
             if(paddr == SCREEN_ADDR) {
-                update_entry(table, index, paddr, paddr, (PE_P | PE_RW | PE_US));
-                uint32_t l = get_directory_index(paddr);
-                kernel.page_directory[l] |= PE_US;
+                update_entry(kernel.page_directory, table, index, paddr, paddr, (PE_P | PE_RW | PE_US | global));
             }else {
-                update_entry(table, index, paddr, paddr, (PE_P | PE_RW));
+                update_entry(kernel.page_directory, table, index, paddr, paddr, (PE_P | PE_RW | global));
             }
             paddr += PAGE_SIZE;
         }
+        // The kernel uses the same table as the processes (see setup_page_table).
+        // A global 4MB page here would give the user pages in it a second
+        // global translation, which the cpu does not allow.
+        update_entry(kernel.page_directory, kernel.page_directory, i, vaddr, (uint32_t)table,
+                     (PE_P | PE_RW));
     }
+    flush_tlb();
 }
 
 
@@ -231,59 +1104,666 @@ int identity_map(uint32_t address, uint32_t size)
 
     // It should only be 1 table and 1 page but i added the for loops just in case.
     for(uint32_t i = 0; i < nrOfTables; i++) {
-        uint32_t table = create_table(addr, kernel, (PE_P | PE_RW | PE_US));
+        uint32_t table = create_table(addr, &kernel, (PE_P | PE_RW | PE_US));
         for(int i = 0; (i < PAGE_N_ENTRIES) && pagesAdded < nrOfPages; i++) {
             uint32_t index = get_table_index(addr);
-            update_entry(table, index, addr, addr, (PE_P | PE_RW | PE_US));
+            update_entry(kernel.page_directory, table, index, addr, addr, (PE_P | PE_RW | PE_US));
             addr += PAGE_SIZE;
             pagesAdded++;
         }
    }
+   flush_tlb();
    return SUCCESS;
 }
 
+/* Switches to the address space of a process, called from dispatch()
+ * Tasks using the same page directory (threads) leave cr3 alone, so
+ * their TLB entries are kept.
+ * returns: FALSE if the directory was already loaded
+ */
+bool_t select_page_directory(pcb_t* p)
+{
+    if(p->page_directory == current_directory()) {
+        return FALSE;
+    }
+    load_directory(p->page_directory);
+    return TRUE;
+}
+
 void setup_page_table(pcb_t *p)
 {
     lock_acquire(&memory_lock);
     if(p->is_thread) {
         p->page_directory = kernel.page_directory;
     }else {
-        p->page_directory = get_memory(TRUE, 0, *p);
+        // Every entry is copied from the kernel directory, no need to zero it
+        p->page_directory = get_memory(TRUE, FALSE, 0, p);
         // Set pointer to kernel pages
         // We copy over all entries, because of identity_map
         // Then we just write over/replace empty entries below
         for(int i = 0; i < PAGE_N_ENTRIES; i++) {
             p->page_directory[i] = kernel.page_directory[i];
         }
+        // The kernel region goes through the shared tables, so the screen can be user accessible
+        for(int i = 0; i < N_KERNEL_PTS; i++) {
+            p->page_directory[i] = (uint32_t)kernel_tables[i] | (PE_P | PE_RW | PE_US);
+        }
 
         // Adding table for stack
-       uint32_t table = create_table(PROCESS_STACK, *p, (PE_P | PE_RW | PE_US));
-        // Adding stack pages, presented
-        for(int j = 0; j < 2; j++) {
-            uint32_t stackaddr = PROCESS_STACK - (j * PAGE_SIZE);
-            uint32_t index = get_table_index(stackaddr);
-            uint32_t page = get_memory(TRUE, stackaddr, *p);
-            update_entry(table, index, stackaddr, page, (PE_P | PE_RW | PE_US));
-        }
-
-        //How many pages do we need for data/code
-        uint32_t nrOfPages = (p->swap_size + SECTORS_PER_PAGE -1) / SECTORS_PER_PAGE;
-        uint32_t nrOfTables = (nrOfPages / PAGE_N_ENTRIES) + 1;
-
-        uint32_t pagesAdded = 0;
-        uint32_t vaddr = PROCESS_ENTRY;
-        for(uint32_t i = 0; i < nrOfTables; i++) {
-           uint32_t table = create_table(vaddr, *p, (PE_P | PE_RW | PE_US));
-            // Adding code pages, not presented
-            for(int i = 0; (i < PAGE_N_ENTRIES) && pagesAdded < nrOfPages; i++) {
-                uint32_t index = get_table_index(vaddr);
-                update_entry(table, index, vaddr, 0, (PE_RW | PE_US));
-                vaddr += PAGE_SIZE;
-                pagesAdded++;
+        uint32_t table = create_table(PROCESS_STACK, p, (PE_P | PE_RW | PE_US));
+        // The table is empty, keep it from being evicted by the next get_memory
+        uint32_t t = get_block_index(table);
+        memoryblocks[t].pinned = TRUE;
+        // Adding the top stack page, presented. The rest is added on faults
+        uint32_t index = get_table_index(STACK_TOP);
+        uint32_t page = get_memory(TRUE, TRUE, STACK_TOP, p);
+        map_block(page, (uint32_t*)table, index, (PE_P | PE_RW | PE_US));
+        memoryblocks[t].pinned = FALSE;
+        // The kernel data page, read-only
+        update_entry(p->page_directory, (uint32_t*)table, get_table_index(KDATA_ADDR), KDATA_ADDR,
+                     (uint32_t)&kdata_page, (PE_P | PE_US));
+
+        // Tables for data/code are made on the first fault in their range
+        // Registered last, get_memory can let others look at the address
+        // spaces while the directory is half done.
+        // Processes without an entry here just dont share image pages
+        add_vms(p);
+    }
+    memory_unlock();
+}
+
+/* Unmaps a page of a process, giving back its memory block or swap slot.
+ * Dirty pages of memory mapped files are written back to the file.
+ * Called with memory_lock held, which is released while waiting for I/O.
+ */
+static void unmap_page(pcb_t* p, uint32_t vaddr) {
+    while(1) {
+        uint32_t dir_entry = p->page_directory[get_directory_index(vaddr)];
+        if((dir_entry & PE_P) == 0) {
+            return;
+        }
+        uint32_t* table = (uint32_t*)(dir_entry & PE_BASE_ADDR_MASK);
+        uint32_t index = get_table_index(vaddr);
+        if((table[index] & PE_P) != 0) {
+            uint32_t i = get_block_index(table[index] & PE_BASE_ADDR_MASK);
+            if(memoryblocks[i].in_transit == TRUE) {
+                wait_io(i);
+                continue;
+            }
+            bool_t dirty = (table[index] & PE_D) != 0;
+            update_entry(p->page_directory, table, index, vaddr, 0, 0);
+            if(memoryblocks[i].file != NULL && dirty) {
+                write_file_page(i);
             }
+            put_memory(i);
+        } else if((table[index] & PE_SWAP) != 0) {
+            int slot = table[index] >> PE_BASE_ADDR_BITS;
+            int writing = find_swap_out(slot);
+            if(writing >= 0) {
+                wait_io(writing);
+                continue;
+            }
+            update_entry(p->page_directory, table, index, vaddr, 0, 0);
+            free_swap_slot(slot);
         }
+        return;
     }
-    lock_release(&memory_lock);
+}
+
+/*
+ * Moves the end of the heap of the current process, syscall registered
+ * in kernel.c. New pages are mapped when they are first used.
+ * params:
+ *   int increment : bytes to grow the heap with, negative to shrink it
+ * returns: the old end of the heap, or -1 if it can not be moved
+ */
+int do_sbrk(int increment)
+{
+    lock_acquire(&memory_lock);
+    struct VMS* vms = get_vms(current_running);
+    if(vms == NULL) {
+        memory_unlock();
+        return -1;
+    }
+    uint32_t old_brk = vms->brk;
+    uint32_t new_brk = old_brk + increment;
+    uint32_t heap_start = get_heap_start(current_running);
+    if((increment < 0 && new_brk > old_brk) || (increment > 0 && new_brk < old_brk)
+       || new_brk < heap_start || new_brk > heap_start + (HEAP_MAX_PAGES * PAGE_SIZE)) {
+        memory_unlock();
+        return -1;
+    }
+    vms->brk = new_brk;
+    // Give back the pages that are no longer part of the heap
+    uint32_t vaddr = (new_brk + PAGE_SIZE - 1) & PE_BASE_ADDR_MASK;
+    for(; vaddr < old_brk; vaddr += PAGE_SIZE) {
+        unmap_page(current_running, vaddr);
+    }
+    memory_unlock();
+    return old_brk;
+}
+
+/* Unmaps a memory mapped file, writing back the pages that were changed */
+static void unmap_file(pcb_t* p, struct MMS* map) {
+    for(uint32_t vaddr = map->vaddr; vaddr < map->vaddr + map->size; vaddr += PAGE_SIZE) {
+        unmap_page(p, vaddr);
+    }
+    fs_unmap(map->inode);
+    map->inode = -1;
+}
+
+/*
+ * Maps a open file into the address space of the current process,
+ * syscall registered in kernel.c. Pages are read from the file when
+ * they are first used.
+ * params:
+ *   int fd : file descriptor of the file
+ * returns: the address of the mapping, or -1 if the file can not be mapped
+ */
+int do_mmap(int fd)
+{
+    lock_acquire(&memory_lock);
+    struct VMS* vms = get_vms(current_running);
+    struct MMS* map = NULL;
+    for(int m = 0; vms != NULL && m < MAX_MAPPINGS; m++) {
+        if(vms->maps[m].inode < 0) {
+            map = &vms->maps[m];
+            break;
+        }
+    }
+    if(map == NULL) {
+        memory_unlock();
+        return -1;
+    }
+    int size;
+    int writable;
+    int inode = fs_map(fd, &size, &writable);
+    if(inode < 0) {
+        memory_unlock();
+        return -1;
+    }
+    if(size <= 0 || size > MMAP_SPAN) {
+        fs_unmap(inode);
+        memory_unlock();
+        return -1;
+    }
+    map->inode = inode;
+    map->size = size;
+    map->writable = writable;
+    memory_unlock();
+    return map->vaddr;
+}
+
+/*
+ * Unmaps a file mapped with do_mmap(), syscall registered in kernel.c.
+ * params:
+ *   uint32_t addr : address returned by do_mmap()
+ * returns: 0, or -1 if nothing is mapped there
+ */
+int do_munmap(uint32_t addr)
+{
+    lock_acquire(&memory_lock);
+    struct VMS* vms = get_vms(current_running);
+    for(int m = 0; vms != NULL && m < MAX_MAPPINGS; m++) {
+        if(vms->maps[m].inode >= 0 && vms->maps[m].vaddr == addr) {
+            unmap_file(current_running, &vms->maps[m]);
+            memory_unlock();
+            return 0;
+        }
+    }
+    memory_unlock();
+    return -1;
+}
+
+/*
+ * Releases the memory blocks owned by a process, called when it exits.
+ * The page directory is still in use until we are switched away from,
+ * so it is left for reclaim_exited() to pick up.
+ */
+void free_memory(pcb_t *p)
+{
+    if(p->is_thread) {
+        return;
+    }
+    lock_acquire(&memory_lock);
+    struct VMS* vms = get_vms(p);
+    if(vms != NULL) {
+        for(int m = 0; m < MAX_MAPPINGS; m++) {
+            if(vms->maps[m].inode >= 0) {
+                unmap_file(p, &vms->maps[m]);
+            }
+        }
+    }
+    // Let disk I/O on our pages finish, before their swap slots are given away.
+    // wait_io releases memory_lock and others can start I/O on another of
+    // our blocks meanwhile, so look again from the start after every wait.
+    // Nothing below releases the lock.
+    int n = 0;
+    while(n < pageable_pages) {
+        if(memoryblocks[n].pcb == p && memoryblocks[n].in_transit == TRUE) {
+            wait_io(n);
+            n = 0;
+        } else {
+            n++;
+        }
+    }
+    if(vms != NULL) {
+        vms->pcb = NULL;
+    }
+    // Drop shared pages, and give back the swap slots of pages that are swapped out
+    for(int d = 0; d < PAGE_N_ENTRIES; d++) {
+        uint32_t dir_entry = p->page_directory[d];
+        if((dir_entry & PE_P) == 0 || dir_entry == kernel.page_directory[d] || d < N_KERNEL_PTS) {
+            continue;
+        }
+        uint32_t* table = (uint32_t*)(dir_entry & PE_BASE_ADDR_MASK);
+        for(int t = 0; t < PAGE_N_ENTRIES; t++) {
+            if((table[t] & (PE_P | PE_SWAP)) == PE_SWAP) {
+                free_swap_slot(table[t] >> PE_BASE_ADDR_BITS);
+            } else if((table[t] & PE_P) != 0 && (table[t] & PE_BASE_ADDR_MASK) != (uint32_t)&kdata_page) {
+                uint32_t i = get_block_index(table[t] & PE_BASE_ADDR_MASK);
+                if(memoryblocks[i].cache_loc != 0) {
+                    if((table[t] & PE_A) != 0) {
+                        prefetch_used(i);
+                    }
+                    put_memory(i);
+                }
+            }
+        }
+    }
+    for(int i = 0; i < pageable_pages; i++) {
+        if(memoryblocks[i].refcount > 0 && memoryblocks[i].pcb == p
+           && memoryblocks[i].paddr != (uint32_t)p->page_directory) {
+            put_memory(i);
+        }
+    }
+    memory_unlock();
+}
+
+/* Returns the block caching the image page at a disk location, -1 if none
+ * The block can still be in transit from the disk.
+ */
+static int find_cached(uint32_t location) {
+    for(int i = 0; i < pageable_pages; i++) {
+        if(memoryblocks[i].refcount > 0 && memoryblocks[i].cache_loc == location) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Buffer for reading several image pages with one scsi_read */
+static char prefetch_buffer[PREFETCH_PAGES * PAGE_SIZE];
+/* If a fault is using prefetch_buffer */
+static bool_t prefetch_busy = FALSE;
+
+/* Counts the memory blocks in the free lists */
+static int count_free(void) {
+    int count = zero_count;
+    for(int i = free_list; i >= 0; i = memoryblocks[i].next_free) {
+        count++;
+    }
+    return count;
+}
+
+/* Zeroes the part of a page after the last byte read from the image */
+static inline void zero_tail(uint32_t page, uint32_t bytes) {
+    if(bytes < PAGE_SIZE) {
+        bzero((char*)page + bytes, PAGE_SIZE - bytes);
+    }
+}
+
+/* Checks if a page table entry is neither present nor swapped out */
+static inline bool_t is_unmapped(uint32_t entry) {
+    return (entry & (PE_P | PE_SWAP)) == 0;
+}
+
+/* Updates the read ahead window of a process. A fault right after the pages
+ * read on the last fault means the process runs through its image
+ * sequentially, and the window is doubled. Any other fault closes it.
+ * returns: number of pages to read after the faulting page
+ */
+static int update_prefetch_window(struct VMS* vms, uint32_t vaddr) {
+    if(vaddr == vms->next_fault) {
+        vms->window = (vms->window == 0) ? 1 : vms->window * 2;
+        if(vms->window > PREFETCH_PAGES - 1) {
+            vms->window = PREFETCH_PAGES - 1;
+        }
+    } else {
+        vms->window = 0;
+    }
+    return vms->window;
+}
+
+/* Gives back blocks map_cached() reserved and did not use
+ * params:
+ *   int* blocks : the reserved blocks
+ *   int from, to : the range of blocks to give back
+ */
+static void release_blocks(int* blocks, int from, int to) {
+    for(int n = from; n < to; n++) {
+        memoryblocks[blocks[n]].in_transit = FALSE;
+        condition_broadcast(&memoryblocks[blocks[n]].io_done);
+        put_memory(blocks[n]);
+    }
+}
+
+/* Maps a shared image page read-only into the current process,
+ * reading it into the page cache if no other process has it.
+ * Up to ahead of the following pages are read with the same scsi_read and
+ * mapped as well, as long as they are unmapped, not cached and there are
+ * free memory blocks for them (read ahead never evicts pages).
+ * If another process is reading the page already, we wait for it instead.
+ * params:
+ *   uint32_t* table : page table to map the page in
+ *   uint32_t index : index in table
+ *   uint32_t vaddr : Virtual Address of the page
+ *   uint32_t location : image location of the page
+ *   uint32_t sectors : sectors to read
+ *   int ahead : number of following pages to read
+ * returns: number of pages mapped
+ */
+static int map_cached(uint32_t* table, uint32_t index, uint32_t vaddr,
+                      uint32_t location, uint32_t sectors, int ahead) {
+    uint32_t page;
+    int i;
+retry:
+    while((i = find_cached(location)) >= 0 && memoryblocks[i].in_transit == TRUE) {
+        wait_io(i);
+    }
+    if(i >= 0) {
+        stats.minor_faults++;
+        prefetch_used(i);
+        memoryblocks[i].refcount++;
+        update_entry(current_running->page_directory, table, index, vaddr, memoryblocks[i].paddr, (PE_P | PE_US | PE_COW));
+        return 1;
+    }
+
+    // The faulting page takes one free block (or evicts), the rest need their own
+    uint32_t image_end = current_running->swap_loc + current_running->swap_size;
+    int free = count_free();
+    int pages = 1;
+    while(prefetch_busy == FALSE && pages <= ahead && pages < free && index + pages < PAGE_N_ENTRIES
+          && is_unmapped(table[index + pages])
+          && location + (pages * SECTORS_PER_PAGE) < image_end
+          && find_cached(location + (pages * SECTORS_PER_PAGE)) < 0) {
+        pages++;
+    }
+
+    // Only the fault that set prefetch_busy clears it
+    bool_t prefetching = pages > 1;
+    if(prefetching) {
+        prefetch_busy = TRUE;
+    }
+
+    // Reserve the blocks, in transit so nobody evicts them
+    int blocks[PREFETCH_PAGES];
+    for(int n = 0; n < pages; n++) {
+        page = alloc_memory(FALSE, FALSE, vaddr + (n * PAGE_SIZE), &kernel);
+        if(page == 0) {
+            // Give back what we have, the process is killed and can not do it later
+            release_blocks(blocks, 0, n);
+            if(prefetching) {
+                prefetch_busy = FALSE;
+            }
+            memory_unlock();
+            exit();
+            return 0;
+        }
+        blocks[n] = get_block_index(page);
+        memoryblocks[blocks[n]].in_transit = TRUE;
+    }
+
+    // get_memory can release memory_lock, so someone else may have cached
+    // the pages in the meantime. Check again before they go in the cache.
+    int keep = pages;
+    if(find_cached(location) >= 0) {
+        keep = 0;
+    }
+    for(int n = 1; n < keep; n++) {
+        if(!is_unmapped(table[index + n]) || find_cached(location + (n * SECTORS_PER_PAGE)) >= 0) {
+            keep = n;
+        }
+    }
+    release_blocks(blocks, keep, pages);
+    pages = keep;
+    if(pages == 0) {
+        if(prefetching) {
+            prefetch_busy = FALSE;
+        }
+        goto retry;
+    }
+    stats.major_faults++;
+
+    // Put them in the cache, so others wait for them
+    for(int n = 0; n < pages; n++) {
+        i = blocks[n];
+        memoryblocks[i].cache_loc = location + (n * SECTORS_PER_PAGE);
+        if(n > 0) {
+            // Not used yet, let these go first if the guess was wrong
+            memoryblocks[i].age = 0;
+            memoryblocks[i].history = 0;
+            memoryblocks[i].read_ahead = TRUE;
+            stats.prefetched++;
+        }
+    }
+
+    memory_unlock();
+    uint64_t start = get_timer();
+    if(pages == 1) {
+        scsi_read(location, sectors, (void*)memoryblocks[blocks[0]].paddr);
+        zero_tail(memoryblocks[blocks[0]].paddr, sectors * SECTOR_SIZE);
+    } else {
+        uint32_t end = location + (pages * SECTORS_PER_PAGE);
+        if(end > image_end) {
+            end = image_end;
+        }
+        scsi_read(location, end - location, (void*)prefetch_buffer);
+        for(int n = 0; n < pages; n++) {
+            uint32_t bytes = ((end - location) * SECTOR_SIZE) - (n * PAGE_SIZE);
+            if(bytes > PAGE_SIZE) {
+                bytes = PAGE_SIZE;
+            }
+            bcopy(&prefetch_buffer[n * PAGE_SIZE], (char*)memoryblocks[blocks[n]].paddr, bytes);
+            zero_tail(memoryblocks[blocks[n]].paddr, bytes);
+        }
+    }
+    lock_acquire(&memory_lock);
+    record_latency(stats.read_time, start);
+
+    for(int n = 0; n < pages; n++) {
+        i = blocks[n];
+        memoryblocks[i].in_transit = FALSE;
+        condition_broadcast(&memoryblocks[i].io_done);
+        update_entry(current_running->page_directory, table, index + n, vaddr + (n * PAGE_SIZE), memoryblocks[i].paddr,
+                     (PE_P | PE_US | PE_COW));
+    }
+    if(prefetching) {
+        prefetch_busy = FALSE;
+    }
+    return pages;
+}
+
+/* Maps the image pages around a faulting page that are already in the
+ * page cache, so the process does not fault on each of them.
+ * params:
+ *   uint32_t* table : page table of the faulting page
+ *   uint32_t index : index of the faulting page in table
+ *   uint32_t vaddr : Virtual Address of the faulting page
+ *   uint32_t location : image location of the faulting page
+ */
+static void fault_around(uint32_t* table, uint32_t index, uint32_t vaddr, uint32_t location) {
+    uint32_t image_end = current_running->swap_loc + current_running->swap_size;
+    for(int n = -FAULT_AROUND; n <= FAULT_AROUND; n++) {
+        int t = (int)index + n;
+        if(n == 0 || t < 0 || t >= PAGE_N_ENTRIES || !is_unmapped(table[t])) {
+            continue;
+        }
+        uint32_t loc = location + (n * SECTORS_PER_PAGE);
+        if(loc < current_running->swap_loc || loc >= image_end) {
+            continue;
+        }
+        int i = find_cached(loc);
+        if(i >= 0 && memoryblocks[i].in_transit == FALSE) {
+            prefetch_used(i);
+            memoryblocks[i].refcount++;
+            update_entry(current_running->page_directory, table, t, vaddr + (n * PAGE_SIZE), memoryblocks[i].paddr,
+                         (PE_P | PE_US | PE_COW));
+        }
+    }
+}
+
+/* Resolves a write to a copy-on-write page, giving the current process
+ * a private copy of it
+ * params:
+ *   uint32_t* table : page table the shared page is mapped in
+ *   uint32_t index : index in table
+ *   uint32_t vaddr : Virtual Address of the page
+ */
+static void copy_on_write(uint32_t* table, uint32_t index, uint32_t vaddr) {
+    uint32_t shared = get_block_index(table[index] & PE_BASE_ADDR_MASK);
+    if(memoryblocks[shared].refcount == 1) {
+        // Nobody else uses the page, take it out of the cache instead of copying
+        memoryblocks[shared].cache_loc = 0;
+        memoryblocks[shared].pcb = current_running;
+        memoryblocks[shared].vaddr = vaddr;
+        map_block(memoryblocks[shared].paddr, table, index, (PE_P | PE_RW | PE_US));
+        return;
+    }
+
+    // Pin the shared page so get_memory does not evict it before we copy it
+    memoryblocks[shared].pinned = TRUE;
+    uint32_t page = alloc_memory(FALSE, FALSE, vaddr, current_running);
+    memoryblocks[shared].pinned = FALSE;
+    if(page == 0) {
+        memory_unlock();
+        exit();
+        return;
+    }
+
+    bcopy((char*)memoryblocks[shared].paddr, (char*)page, PAGE_SIZE);
+    map_block(page, table, index, (PE_P | PE_RW | PE_US));
+    put_memory(shared);
+}
+
+/* Makes the faulting page present, called from page_fault_handler() with
+ * memory_lock held and the page table pinned.
+ * params:
+ *   uint32_t* entry : page table of the faulting address
+ *   uint32_t index : index in the table
+ *   uint32_t vaddr : page aligned faulting address
+ *   uint32_t location : image location of the page
+ *   uint32_t sectors : sectors of the image in the page
+ *   int region : region of the address space the page is in
+ */
+static void resolve_fault(uint32_t* entry, uint32_t index, uint32_t vaddr,
+                          uint32_t location, uint32_t sectors, int region) {
+    if((current_running->error_code & (PE_P)) != 0) {
+        // Writing to a copy-on-write page, anything else is a real protection fault
+        if((current_running->error_code & PE_RW) != 0 && (entry[index] & PE_COW) != 0) {
+            stats.minor_faults++;
+            copy_on_write(entry, index, vaddr);
+            return;
+        }
+        scrprintf(0,30,"PID: %i : Access Denied %x", current_running->pid, current_running->fault_addr);
+        memory_unlock();
+        exit();
+        return;
+    }
+    // Some sources says this bit is reserved/not used
+    /*
+    if((current_running->error_code & (PE_PWT)) != 0) {
+        scrprintf(0,30,
+                  "PID: %i : Writing to read-only memory: %x", current_running->pid, current_running->fault_addr);
+        memory_unlock();
+        exit();
+        return;
+    }
+    */
+
+    // The stack and heap get zeroed pages, swapped out ones are read back below
+    if((region == REGION_STACK || region == REGION_HEAP) && (entry[index] & PE_SWAP) == 0) {
+        stats.minor_faults++;
+        uint32_t page = get_memory(FALSE, TRUE, vaddr, current_running);
+        map_block(page, entry, index, (PE_P | PE_RW | PE_US));
+        return;
+    }
+
+    // Memory mapped files are read through the filesystem
+    if(region == REGION_FILE) {
+        struct MMS* map = get_file_mapping(get_vms(current_running), vaddr);
+        uint32_t pos = vaddr - map->vaddr;
+        uint32_t bytes = map->size - pos;
+        if(bytes > PAGE_SIZE) {
+            bytes = PAGE_SIZE;
+        }
+        // Pinned, see the note at the top
+        uint32_t page = get_memory(TRUE, FALSE, vaddr, current_running);
+        uint32_t i = get_block_index(page);
+        memoryblocks[i].file = map;
+        stats.major_faults++;
+        start_io(i);
+        uint64_t start = get_timer();
+        db_read(map->inode, (char*)page, bytes, pos);
+        zero_tail(page, bytes);
+        record_latency(stats.read_time, start);
+        end_io(i);
+        map_block(page, entry, index,
+                  map->writable ? (PE_P | PE_RW | PE_US) : (PE_P | PE_US));
+        return;
+    }
+
+    // Image pages are shared with other processes from the same image.
+    // A write fault copies the page straight away, which costs nothing if
+    // no other process had it cached.
+    struct VMS* vms = get_vms(current_running);
+    if((entry[index] & PE_SWAP) == 0 && vms != NULL) {
+        int ahead = update_prefetch_window(vms, vaddr);
+        int pages = map_cached(entry, index, vaddr, location, sectors, ahead);
+        vms->next_fault = vaddr + (pages * PAGE_SIZE);
+        if((current_running->error_code & PE_RW) != 0) {
+            copy_on_write(entry, index, vaddr);
+        }
+        fault_around(entry, index, vaddr, location);
+        return;
+    }
+
+    // The page might still be on its way out to its swap slot. Wait before
+    // taking a block, so the block is not left unmapped while we wait.
+    int slot = -1;
+    if((entry[index] & PE_SWAP) != 0) {
+        slot = entry[index] >> PE_BASE_ADDR_BITS;
+        int writing;
+        while((writing = find_swap_out(slot)) >= 0) {
+            wait_io(writing);
+        }
+    }
+
+    // Get a page to write to, it is filled from disk so it is not zeroed
+    uint32_t page = get_memory(FALSE, FALSE, vaddr, current_running);
+    uint32_t i = get_block_index(page);
+    stats.major_faults++;
+
+    // Read inn from disk, from the swap area if the page has been swapped out
+    if(slot >= 0) {
+        // Keep the slot, if the page stays clean it can be dropped on eviction
+        memoryblocks[i].swap_slot = slot;
+        start_io(i);
+        uint64_t start = get_timer();
+        scsi_read(get_swap_location(slot), SECTORS_PER_PAGE, (void*)page);
+        record_latency(stats.read_time, start);
+        end_io(i);
+    } else {
+        start_io(i);
+        uint64_t start = get_timer();
+        scsi_read(location, sectors, (void*)page);
+        zero_tail(page, sectors * SECTOR_SIZE);
+        record_latency(stats.read_time, start);
+        end_io(i);
+    }
+
+    // Update page table entry
+    map_block(page, entry, index, (PE_P | PE_RW | PE_US));
 }
 
 /*
@@ -294,48 +1774,427 @@ void setup_page_table(pcb_t *p)
  */
 void page_fault_handler(void)
 {
+    uint64_t start = get_timer();
     lock_acquire(&memory_lock);
+    record_latency(stats.lock_time, start);
     current_running->page_fault_count++;
 
+    // Suspended by the load control, wait until there is room for us again
+    struct VMS* vms = get_vms(current_running);
+    while(vms != NULL && vms->suspended == TRUE) {
+        flush_tlb();
+        condition_wait(&memory_lock, &admitted);
+    }
+
     //scrprintf(7,0,"Faulting addr: %X, %i", current_running->fault_addr, current_running->pid);
 
     /* Some error messages for page fault */
     if(current_running->fault_addr == 0) {
         scrprintf(0,30,"PID: %i : Null pointer error", current_running->pid);
-        lock_release(&memory_lock);
+        memory_unlock();
         exit();
         return; // not reached i guess
     }
-    if((current_running->error_code & (PE_P)) != 0) {
+    if(current_running->fault_addr < N_KERNEL_PTS * PTABLE_SPAN) {
         scrprintf(0,30,"PID: %i : Access Denied %x", current_running->pid, current_running->fault_addr);
-        lock_release(&memory_lock);
-        exit();
-        return;
-    }
-    // Some sources says this bit is reserved/not used
-    /*
-    if((current_running->error_code & (PE_PWT)) != 0) {
-        scrprintf(0,30,
-                  "PID: %i : Writing to read-only memory: %x", current_running->pid, current_running->fault_addr);
-        lock_release(&memory_lock);
+        memory_unlock();
         exit();
         return;
     }
-    */
 
     // Get page table entry and disk information
+    uint32_t vaddr = current_running->fault_addr & PE_BASE_ADDR_MASK;
     uint32_t location;
     uint32_t sectors;
+
+    int region = get_region(current_running, vaddr);
+    if(region == REGION_GUARD) {
+        scrprintf(0,30,"PID: %i : Stack overflow %x", current_running->pid, current_running->fault_addr);
+        memory_unlock();
+        exit();
+        return;
+    }
+    if(region == REGION_NONE && (current_running->error_code & PE_P) == 0) {
+        scrprintf(0,30,"PID: %i : Segmentation fault %x", current_running->pid, current_running->fault_addr);
+        memory_unlock();
+        exit();
+        return;
+    }
+
+    // Page tables are made on the first fault in their range
+    if((current_running->page_directory[get_directory_index(vaddr)] & PE_P) == 0) {
+        create_table(vaddr, current_running, (PE_P | PE_RW | PE_US));
+    }
     uint32_t* entry = get_entry_and_location(current_running->fault_addr, current_running, &location, &sectors);
+    uint32_t index = get_table_index(current_running->fault_addr);
 
-    // Get a page to write to
-    uint32_t page = get_memory(FALSE, current_running->fault_addr, *current_running);
+    // The table might be empty, keep it from being evicted while we fill it
+    uint32_t t = get_block_index((uint32_t)entry);
+    bool_t pinned = memoryblocks[t].pinned;
+    memoryblocks[t].pinned = TRUE;
+    resolve_fault(entry, index, vaddr, location, sectors, region);
+    memoryblocks[t].pinned = pinned;
+    memory_unlock();
+}
 
-    // Read inn from disk
-    scsi_read(location, sectors, (void*)page);
+/* Counts the blocks that can be reused without writing anything to disk */
+static int count_clean(void) {
+    int count = count_free();
+    for(int i = 0; i < pageable_pages; i++) {
+        if(can_evict(i) == TRUE && is_dirty(i) == FALSE) {
+            count++;
+        }
+    }
+    return count;
+}
 
-    // Update page table entry
-    uint32_t index = get_table_index(current_running->fault_addr);
-    update_entry(entry, index, current_running->fault_addr, page, (PE_P | PE_RW | PE_US));
-    lock_release(&memory_lock);
+/* Counts the blocks that are pinned */
+static int count_pinned(void) {
+    int count = 0;
+    for(int i = 0; i < pageable_pages; i++) {
+        if(memoryblocks[i].refcount > 0 && memoryblocks[i].pinned == TRUE) {
+            count++;
+        }
+    }
+    return count;
+}
+
+/* Buffer for writing pages in consecutive swap slots with one scsi_write */
+static char clean_buffer[CLEAN_BATCH * PAGE_SIZE];
+
+/* Writes a batch of dirty pages to their swap slots, starting with the
+ * ones the clock hand gets to next. The pages are written in swap slot
+ * order, and pages in consecutive slots are written with one scsi_write.
+ * The pages stay mapped and keep their slot, so they can be dropped when
+ * evicted unless they are written to again.
+ * Called with memory_lock held, it is released during the writes.
+ */
+static void clean_pages(void) {
+    int batch[CLEAN_BATCH];
+    int count = 0;
+    for(int n = 0; n < pageable_pages && count < CLEAN_BATCH; n++) {
+        uint32_t i = (clock_hand + n) % pageable_pages;
+        if(can_evict(i) == FALSE || is_dirty(i) == FALSE) {
+            continue;
+        }
+        if(memoryblocks[i].swap_slot < 0) {
+            memoryblocks[i].swap_slot = alloc_swap_slot();
+            if(memoryblocks[i].swap_slot < 0) { // Swap area is full
+                break;
+            }
+        }
+        // Keep the batch sorted on swap slot
+        int k = count++;
+        while(k > 0 && memoryblocks[batch[k - 1]].swap_slot > memoryblocks[i].swap_slot) {
+            batch[k] = batch[k - 1];
+            k--;
+        }
+        batch[k] = i;
+    }
+    if(count == 0) {
+        return;
+    }
+
+    for(int n = 0; n < count; n++) {
+        uint32_t i = batch[n];
+        uint32_t index;
+        uint32_t* table = get_mapping(i, memoryblocks[i].pcb, &index);
+        // A write from now on makes the page dirty again
+        update_entry(memoryblocks[i].pcb->page_directory, table, index, memoryblocks[i].vaddr, memoryblocks[i].paddr, table[index] & ~PE_D);
+        memoryblocks[i].in_transit = TRUE;
+        stats.writebacks++;
+    }
+
+    memory_unlock();
+    for(int n = 0; n < count;) {
+        int first = memoryblocks[batch[n]].swap_slot;
+        int run = 1;
+        while(n + run < count && memoryblocks[batch[n + run]].swap_slot == first + run) {
+            run++;
+        }
+        if(run == 1) {
+            scsi_write(get_swap_location(first), SECTORS_PER_PAGE, (void*)memoryblocks[batch[n]].paddr);
+        } else {
+            for(int k = 0; k < run; k++) {
+                bcopy((char*)memoryblocks[batch[n + k]].paddr, &clean_buffer[k * PAGE_SIZE], PAGE_SIZE);
+            }
+            scsi_write(get_swap_location(first), run * SECTORS_PER_PAGE, (void*)clean_buffer);
+        }
+        n += run;
+    }
+    lock_acquire(&memory_lock);
+
+    for(int n = 0; n < count; n++) {
+        memoryblocks[batch[n]].in_transit = FALSE;
+        condition_broadcast(&memoryblocks[batch[n]].io_done);
+    }
+}
+
+/* Zeroes free blocks and moves them to the zeroed pool, until the pool
+ * is full. A block is in neither list while memory_lock is released,
+ * nobody else looks at free blocks so it is safe.
+ * Called with memory_lock held.
+ */
+static void fill_zero_pool(void) {
+    while(zero_count < ZERO_POOL && free_list >= 0) {
+        int i = free_list;
+        free_list = memoryblocks[i].next_free;
+
+        memory_unlock();
+        bzero((char*)memoryblocks[i].paddr, PAGE_SIZE);
+        lock_acquire(&memory_lock);
+
+        memoryblocks[i].next_free = zero_list;
+        zero_list = i;
+        zero_count++;
+    }
+}
+
+/* Shifts the accessed bits into the history of the blocks, and counts the
+ * pages each running process used in the last samples (WS_RECENT).
+ * A shared page counts once, for the first process that maps it, so the
+ * sum of the working sets is the memory they need.
+ */
+static void sample_working_sets(void) {
+    for(int v = 0; v < MAX_ADDRESS_SPACES; v++) {
+        if(address_spaces[v].suspended == FALSE) {
+            address_spaces[v].working_set = 0;
+        }
+    }
+    for(int i = 0; i < pageable_pages; i++) {
+        if(memoryblocks[i].refcount == 0 || memoryblocks[i].pinned == TRUE
+           || memoryblocks[i].is_table == TRUE || memoryblocks[i].in_transit == TRUE) {
+            continue;
+        }
+        memoryblocks[i].history >>= 1;
+        if(test_and_clear_accessed(i) == TRUE) {
+            memoryblocks[i].history |= 0x80;
+            // The replacement still has to see it
+            memoryblocks[i].sampled = TRUE;
+        }
+        if((memoryblocks[i].history & WS_RECENT) == 0) {
+            continue;
+        }
+        for(int v = 0; v < MAX_ADDRESS_SPACES; v++) {
+            uint32_t index;
+            if(address_spaces[v].pcb != NULL && address_spaces[v].suspended == FALSE
+               && get_mapping(i, address_spaces[v].pcb, &index) != NULL) {
+                address_spaces[v].working_set++;
+                break;
+            }
+        }
+    }
+}
+
+/* Evicts every page of a process that can be evicted, and its empty tables.
+ * Shared pages are only unmapped from it, the others keep them. Nothing
+ * but its pinned pages is left mapped, so it faults on its next
+ * instruction and waits in page_fault_handler.
+ * memory_lock is released while dirty pages are written.
+ */
+static void swap_out_process(pcb_t* p) {
+    for(int i = 0; i < pageable_pages; i++) {
+        uint32_t index;
+        uint32_t* table;
+        if(memoryblocks[i].cache_loc == 0 || can_evict(i) == FALSE
+           || (table = get_mapping(i, p, &index)) == NULL) {
+            continue;
+        }
+        if((table[index] & PE_A) != 0) {
+            prefetch_used(i);
+        }
+        update_entry(p->page_directory, table, index, memoryblocks[i].vaddr, 0, 0);
+        put_memory(i);
+    }
+    for(int pass = 0; pass < 2; pass++) {
+        for(int i = 0; i < pageable_pages; i++) {
+            // Pages first, then the tables they leave empty
+            if(memoryblocks[i].pcb != p || memoryblocks[i].cache_loc != 0
+               || memoryblocks[i].is_table != (pass == 1) || can_evict(i) == FALSE) {
+                continue;
+            }
+            if(swap_out(i) == FALSE) {
+                return;
+            }
+            put_memory(i);
+        }
+    }
+}
+
+/* If a process was let back in by control_load() too recently to be
+ * suspended again
+ */
+static inline bool_t in_turn(struct VMS* vms, uint32_t now) {
+    return vms->resumed_at != 0 && now - vms->resumed_at < SUSPEND_TICKS;
+}
+
+/* Load control, suspends a process when the working sets do not fit in
+ * memory and the processes keep faulting, and lets the process that has
+ * waited longest run again when its working set fits, or when it has
+ * waited SUSPEND_TICKS. The newest process is suspended, but not one that
+ * was let back in during the last SUSPEND_TICKS, so under lasting
+ * pressure the processes take turns instead of one waiting forever.
+ * Called with memory_lock held.
+ */
+static void control_load(void) {
+    static uint32_t sampled_faults = 0;
+    sample_working_sets();
+    uint32_t faults = stats.major_faults - sampled_faults;
+    sampled_faults = stats.major_faults;
+    uint32_t now = get_ticks();
+
+    int available = pageable_pages - count_pinned();
+    int demand = 0;
+    int active = 0;
+    struct VMS* newest = NULL;
+    struct VMS* waiting = NULL;
+    for(int v = 0; v < MAX_ADDRESS_SPACES; v++) {
+        struct VMS* vms = &address_spaces[v];
+        if(vms->pcb == NULL) {
+            continue;
+        }
+        if(vms->suspended == TRUE) {
+            if(waiting == NULL || vms->suspended_at < waiting->suspended_at) {
+                waiting = vms;
+            }
+            continue;
+        }
+        demand += vms->working_set;
+        active++;
+        // Processes just let back in go last, their turn is not over yet
+        if(newest == NULL || (in_turn(newest, now) && !in_turn(vms, now))
+           || (in_turn(newest, now) == in_turn(vms, now) && vms->pcb->pid > newest->pcb->pid)) {
+            newest = vms;
+        }
+    }
+
+    if(waiting != NULL && (demand + waiting->working_set <= available
+                           || now - waiting->suspended_at >= SUSPEND_TICKS)) {
+        // If it does not fit, the next sample suspends someone else
+        waiting->suspended = FALSE;
+        waiting->resumed_at = now;
+        condition_broadcast(&admitted);
+    } else if(faults >= THRASH_FAULTS && demand > available && active > 1) {
+        // The working set is kept, so we know how much room it needs to come back
+        newest->suspended = TRUE;
+        newest->suspended_at = now;
+        stats.suspensions++;
+        swap_out_process(newest->pcb);
+    }
+}
+
+/*
+ * Kernel thread that keeps at least CLEAN_TARGET blocks ready to be
+ * evicted without a write, by writing back dirty pages in batches.
+ * When there is nothing to write it zeroes free blocks for get_memory.
+ * It also redraws the paging statistics panel after new faults, and runs
+ * the load control every WS_SAMPLE_TICKS ticks.
+ * It does one round each time cleaner_wake is signaled, and sleeps in
+ * between, so it takes no cpu time while memory is plentiful.
+ */
+void page_cleaner(void)
+{
+    uint32_t shown_faults = 0;
+    uint32_t sampled_at = 0;
+    while(1) {
+        lock_acquire(&memory_lock);
+        condition_wait(&memory_lock, &cleaner_wake);
+        uint32_t now = get_ticks();
+        if(now - sampled_at >= WS_SAMPLE_TICKS) {
+            sampled_at = now;
+            control_load();
+        }
+        if(count_clean() < CLEAN_TARGET) {
+            clean_pages();
+        } else {
+            fill_zero_pool();
+        }
+        uint32_t faults = stats.major_faults + stats.minor_faults;
+        memory_unlock();
+        // Keep the statistics panel up to date
+        if(faults != shown_faults) {
+            shown_faults = faults;
+            print_paging_stats();
+        }
+    }
+}
+
+/*
+ * Updates the kernel data page, and wakes the page cleaner every
+ * CLEANER_TICKS ticks. Called with interrupts off.
+ * params:
+ *   bool_t tick : TRUE from the timer interrupt, FALSE from dispatch()
+ */
+void update_kdata(bool_t tick)
+{
+    struct kernel_data* kdata = &kdata_page.data;
+    // Odd while writing, a process reading it in between tries again
+    kdata->seq++;
+    asm volatile("" ::: "memory");
+    kdata->pid = current_running->pid;
+    kdata->sysenter = sysenter_ready;
+    if(tick) {
+        // get_timer() reads the time stamp counter, measure a tick with it
+        uint64_t now = get_timer();
+        if(kdata->ticks > 0) {
+            kdata->cycles_per_tick = (uint32_t)(now - kdata->tsc);
+            kdata->tick_scale = 0xffffffff / kdata->cycles_per_tick;
+        }
+        kdata->tsc = now;
+        kdata->ticks++;
+    }
+    asm volatile("" ::: "memory");
+    kdata->seq++;
+    if(tick && kdata->ticks % CLEANER_TICKS == 0) {
+        condition_signal(&cleaner_wake);
+    }
+}
+
+/* Takes a snapshot of the paging statistics */
+static void copy_paging_stats(struct paging_stats* copy)
+{
+    lock_acquire(&memory_lock);
+    stats.pinned = count_pinned();
+    *copy = stats;
+    memory_unlock();
+}
+
+/*
+ * Copies the paging statistics to a buffer, syscall registered in kernel.c
+ * params:
+ *   struct paging_stats* buffer : where to copy the statistics
+ * returns: 0, the buffer is not checked, see SYSCALLS() in syscall.h
+ */
+int get_paging_stats(struct paging_stats* buffer)
+{
+    struct paging_stats copy;
+    copy_paging_stats(&copy);
+    // The buffer is user memory and can fault, so it is not written with the lock held
+    bcopy((char*)&copy, (char*)buffer, sizeof(copy));
+    return 0;
+}
+
+/* Prints one latency histogram of the paging statistics */
+static void print_histogram(int line, char* name, uint32_t* histogram) {
+    scrprintf(line, 0, "%s", name);
+    for(int b = 0; b < LATENCY_BUCKETS; b++) {
+        scrprintf(line, 8 + (b * 9), "%d ", histogram[b]);
+    }
+}
+
+/*
+ * Prints the paging statistics on the screen, starting at PAGING_STATS_LINE
+ * Latencies are histograms, see record_latency().
+ */
+void print_paging_stats(void)
+{
+    struct paging_stats s;
+    copy_paging_stats(&s);
+    scrprintf(PAGING_STATS_LINE, 0, "Faults: %d major %d minor  Evicted: %d  Written: %d  ",
+              s.major_faults, s.minor_faults, s.evictions, s.writebacks);
+    scrprintf(PAGING_STATS_LINE + 1, 0, "Read ahead: %d (%d used)  Pinned: %d  No victim: %d  Suspended: %d  ",
+              s.prefetched, s.prefetch_hits, s.pinned, s.no_victim, s.suspensions);
+    print_histogram(PAGING_STATS_LINE + 2, "lock", s.lock_time);
+    print_histogram(PAGING_STATS_LINE + 3, "read", s.read_time);
+    print_histogram(PAGING_STATS_LINE + 4, "zero", s.zero_time);
 }
@@ -20,30 +20,165 @@ enum {
     PE_PCD = 1 << 4,                /* page cache disable */
     PE_A = 1 << 5,                  /* accessed */
     PE_D = 1 << 6,                  /* dirty */
+    PE_G = 1 << 8,                  /* global, kept when cr3 is loaded */
+    PE_SWAP = 1 << 9,               /* not present, base address is a swap slot */
+    PE_COW = 1 << 10,               /* read-only, copied on first write */
     PE_BASE_ADDR_BITS = 12,         /* position of base address */
     PE_BASE_ADDR_MASK = 0xfffff000, /* extracts the base address */
 
-    /* Constants to simulate a very small physical memory. */
+    /* Pageable memory starts at MEM_START, and is found from the E820 map
+     * up to the end of the kernel region, see init_memory() */
     MEM_START = 0x100000, /* 1MB */
-    PAGEABLE_PAGES = 35,
-    MAX_PHYSICAL_MEMORY = (MEM_START + PAGEABLE_PAGES * PAGE_SIZE),
-
-    /* number of kernel page tables */
-    N_KERNEL_PTS = 1,
+    MEMORY_DETECT = 0,              /* use the usable memory below MAX_PHYSICAL_MEMORY */
+    MEMORY_STRESS = 1,              /* simulate a very small physical memory */
+    MEMORY_MODE = MEMORY_DETECT,
+    STRESS_PAGES = 35,              /* blocks in MEMORY_STRESS mode */
+
+    /* struct kernel_data, mapped read-only in every process on the page
+     * under PROCESS_ENTRY, see setup_page_table() */
+    KDATA_ADDR = 0xfff000,
+
+    /* E820 memory map stored by the boot block, entry count then entries */
+    E820_MAP = 0x500,
+    E820_MAX_ENTRIES = 32,
+    E820_USABLE = 1,                /* entry type of usable RAM */
+
+    /* Swap area, placed after the filesystem on disk */
+    SWAP_SLOTS = 256,               /* number of pages in the swap area */
+
+    /* Processes that can share pages from the page cache */
+    MAX_ADDRESS_SPACES = 32,
+
+    /* Image pages read per fault for sequential processes (read ahead) */
+    PREFETCH_PAGES = 8,
+    /* Cached pages on each side of a fault that are mapped with it */
+    FAULT_AROUND = 4,
+
+    /* Page cleaner, see page_cleaner() */
+    CLEAN_TARGET = 4,               /* blocks to keep ready for eviction */
+    CLEAN_BATCH = 4,                /* dirty pages written per round */
+    ZERO_POOL = 4,                  /* zeroed free blocks to keep ready */
+    CLEANER_TICKS = 2,              /* timer ticks between rounds when nothing wakes it */
+
+    /* Pages flushed one by one with invlpg, more reloads cr3 */
+    TLB_BATCH = 8,
+
+    /* Largest user stack in pages, a guard page is left below it */
+    STACK_MAX_PAGES = 16,
+
+    /* Largest heap in pages, see do_sbrk() */
+    HEAP_MAX_PAGES = 256,
+
+    /* Memory mapped files per process, see do_mmap() */
+    MAX_MAPPINGS = 4,
+
+    /* Working sets and load control, see control_load() */
+    WS_SAMPLE_TICKS = 16,           /* timer ticks between samples */
+    WS_RECENT = 0xe0,               /* history bits of the samples in the working set */
+    THRASH_FAULTS = 8,              /* major faults between samples that count as thrashing */
+    SUSPEND_TICKS = 128,            /* longest wait, and shortest turn after it */
+
+    /* Latency histograms in the paging statistics, bucket 0 is below
+     * 2^LATENCY_SHIFT cycles and every bucket after it twice as long */
+    LATENCY_BUCKETS = 8,
+    LATENCY_SHIFT = 10,
+    PAGING_STATS_LINE = 19,         /* first screen line of print_paging_stats() */
+
+    /* number of kernel page tables. The kernel region, and with it the
+     * pageable memory, ends at 12MB, below the user stack (PROCESS_STACK)
+     * which has a table of its own in every process */
+    N_KERNEL_PTS = 3,
+    MAX_PHYSICAL_MEMORY = (N_KERNEL_PTS * PTABLE_SPAN),
+
+    /* cpuid (leaf 1, edx) and cr4 bits for global pages */
+    CPUID_PGE = 1 << 13,
+    CR4_PGE = 1 << 7,
+    /* cr0 bit that makes read-only pages read-only for the kernel too */
+    CR0_WP = 1 << 16,
 
     PAGE_DIRECTORY_BITS = 22,           /* position of page dir index */
     PAGE_TABLE_BITS = 12,               /* position of page table index */
     PAGE_DIRECTORY_MASK = 0xffc00000,   /* page directory mask */
     PAGE_TABLE_MASK = 0x003ff000,       /* page table mask */
     PAGE_MASK = 0x00000fff,             /* page offset mask */
-    /* used to extract the 10 lsb of a page directory entry */
-    MODE_MASK = 0x000003ff,
+    /* used to extract the 12 lsb (flags) of a page directory entry */
+    MODE_MASK = 0x00000fff,
+
+    PAGE_TABLE_SIZE = (1024 * 4096 - 1), /* size of a page table in bytes */
 
-    PAGE_TABLE_SIZE = (1024 * 4096 - 1) /* size of a page table in bytes */
+    /* page replacement policy used by get_memory() */
+    REPLACE_CLOCK = 0,          /* second chance on the accessed bit */
+    REPLACE_AGING = 1,          /* approximate working set with aging counters */
+    PAGE_REPLACEMENT = REPLACE_CLOCK
 };
 
 
 /* Prototypes */
+/* Paging statistics, returned by get_paging_stats() */
+struct paging_stats {
+    uint32_t major_faults;          /* faults that read from disk */
+    uint32_t minor_faults;          /* faults resolved without disk I/O */
+    uint32_t evictions;             /* pages taken from a process for another */
+    uint32_t writebacks;            /* dirty pages written to swap or a file */
+    uint32_t prefetched;            /* image pages read ahead */
+    uint32_t prefetch_hits;         /* read ahead pages that were used */
+    uint32_t pinned;                /* blocks pinned right now */
+    uint32_t no_victim;             /* times every block was pinned or busy */
+    uint32_t suspensions;           /* processes suspended by the load control */
+    uint32_t lock_time[LATENCY_BUCKETS]; /* waiting for memory_lock on a fault */
+    uint32_t read_time[LATENCY_BUCKETS]; /* reading a page on a fault */
+    uint32_t zero_time[LATENCY_BUCKETS]; /* zeroing a page */
+};
+
+/* Kernel data page at KDATA_ADDR, processes read it without a syscall.
+ * seq is odd while the kernel writes it, see read_kdata() */
+struct kernel_data {
+    volatile uint32_t seq;
+    int pid;                        /* pid of the running process */
+    uint64_t ticks;                 /* timer interrupts since boot */
+    uint64_t tsc;                   /* time stamp counter at the last tick */
+    uint32_t cycles_per_tick;       /* time stamp counter cycles between ticks */
+    uint32_t tick_scale;            /* 2^32 / cycles_per_tick */
+    uint32_t sysenter;              /* 1 once init_sysenter() has run, see has_sysenter() */
+};
+
+/* Reads the kernel data page, retrying if a tick came in the middle */
+static inline void read_kdata(struct kernel_data * data) {
+    const struct kernel_data * kdata = (const struct kernel_data *)KDATA_ADDR;
+    uint32_t seq;
+    do {
+        while((seq = kdata->seq) & 1)
+            ;
+        asm volatile("" ::: "memory");
+        data->pid = kdata->pid;
+        data->ticks = kdata->ticks;
+        data->tsc = kdata->tsc;
+        data->cycles_per_tick = kdata->cycles_per_tick;
+        data->tick_scale = kdata->tick_scale;
+        data->sysenter = kdata->sysenter;
+        asm volatile("" ::: "memory");
+    } while(kdata->seq != seq);
+}
+
+/* Time since boot in 1/65536 ticks, from the last tick and the time
+ * stamp counter, without a syscall */
+static inline uint64_t kdata_time(void) {
+    struct kernel_data data;
+    uint32_t lo, hi;
+    read_kdata(&data);
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    uint64_t delta = (((uint64_t)hi << 32) | lo) - data.tsc;
+    if(delta > data.cycles_per_tick) {
+        delta = data.cycles_per_tick;
+    }
+    return (data.ticks << 16) + ((delta * data.tick_scale) >> 16);
+}
+
+/* Pid of the running process, without a syscall */
+static inline int kdata_pid(void) {
+    return ((const struct kernel_data *)KDATA_ADDR)->pid;
+}
+
 /* Initialize the memory system, called from kernel.c: _start() */
 void init_memory(void);
 
@@ -56,11 +191,44 @@ int identity_map(uint32_t address, uint32_t size);
  */
 void setup_page_table(pcb_t * p);
 
+/* Load the page directory of a process if it is not loaded already,
+ * called from dispatch(). Returns FALSE if it was already loaded.
+ */
+bool_t select_page_directory(pcb_t * p);
+
+/* Move the end of the heap, syscall. Returns the old end or -1 */
+int do_sbrk(int increment);
+
+/* Map a open file into memory, syscall. Returns the address or -1 */
+int do_mmap(int fd);
+
+/* Unmap a file mapped with do_mmap(), syscall. Returns 0 or -1 */
+int do_munmap(uint32_t addr);
+
+/* Copy the paging statistics to a buffer, syscall. Returns 0 */
+int get_paging_stats(struct paging_stats * buffer);
+
+/* Update the kernel data page, from the timer interrupt (tick = TRUE)
+ * and from dispatch() */
+void update_kdata(bool_t tick);
+
+/* Print the paging statistics on the screen */
+void print_paging_stats(void);
+
+/* Give back the memory used by a process, called from exit() */
+void free_memory(pcb_t * p);
+
 /*
  * Page fault handler, called from interrupt.c: exception_14().
  * Should handle demand paging
  */
 void page_fault_handler(void);
 
+/*
+ * Kernel thread writing dirty pages back to swap in the background,
+ * started from kernel.c
+ */
+void page_cleaner(void);
+
 
 #endif /* !MEMORY_H */
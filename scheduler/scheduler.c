@@ -5,6 +5,7 @@
 #include "kernel.h"
 #include "scheduler.h"
 #include "util.h"
+#include "memory.h"
 
 
 /* Call scheduler to run the 'next' process */
@@ -41,11 +42,18 @@ void scheduler(void) {
     dispatch();
 }
 
+/* Switches where the next task used the same address space */
+int nrOfSharedSwitches = 0;
+
 /* dispatch() does not restore gpr's it just pops down the kernel_stack,
  * and returns to whatever called scheduler (which happens to be
  * scheduler_entry, in entry.S).
  */
 void dispatch(void) {
+    if(select_page_directory(current_running) == FALSE) {
+        nrOfSharedSwitches++; // Same address space, the TLB is kept
+    }
+    update_kdata(FALSE);
     if(current_running->state == STATUS_FIRST_TIME) {
         current_running->state = STATUS_READY;
         start_process();
@@ -59,6 +67,7 @@ void dispatch(void) {
  * will not be scheduled in the future
  */
 void exit(void) {
+    free_memory(current_running);
     current_running->state = STATUS_EXITED;
     scheduler_entry();
 }
@@ -113,6 +122,7 @@ void end_timer(){
         uint64_t duration = get_timer() - timer; // get duration as early as possible
         scrprintf(17,0,"                                                                ");
         scrprintf(17,50,"Count: %d.", ++nrOfSwitches);
+        scrprintf(18,50,"Same space: %d.", nrOfSharedSwitches);
 
         if(type == 0) { // Check if we are starting from process or thread
             if(current_running->type == 1) {